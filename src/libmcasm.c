@@ -0,0 +1,4661 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcasm.h"
+#include "mcpatch.h"
+#include "microcode.h"
+
+#define MAX_TOKEN_LENGTH 255
+#define MAX_OPTIONS 4 // max identifiers to define an cmd option
+// construct the microcode address for cmdId at the current cmdSet and page
+#define MC_ADDR(cmdId) mcAddr(ctx, ctx->cmdSet, ctx->page, cmdId)
+// limits of the geometry; a label's step must fit in an immediate value
+#define MAX_STEP_BITS 8
+#define MAX_CMDS_PER_GRP (1 << MAX_STEP_BITS)
+#define MAX_ADDR_BITS 24
+
+#define NELEMS(a) ((int)(sizeof(a) / sizeof((a)[0]))) // copied from LCC
+
+#define SYSTEM_TOKENS             \
+	XX(EXPORT, "export")          \
+	XX(DEF, "def")                \
+	XX(SET, "set")                \
+	XX(ZET, "zet")                \
+	XX(PORT, "port")              \
+	XX(REG, "reg")                \
+	XX(FORGET, "forget")          \
+	XX(CMDSET, "cmdSet")          \
+	XX(PAGE, "page")              \
+	XX(GRP, "grp")                \
+	XX(COMMENT_START, ";")        \
+	XX(ON, "on")                  \
+	XX(OFF, "off")                \
+	XX(EQ, "=")                   \
+	/* Cmd with tst bit set */    \
+	XX(EQ_TEST, "=?")             \
+	/* Immediate cmd */           \
+	XX(EQ_IMM, "=#")              \
+	/* Immediate cmd; value */    \
+	/* from cmdGrp local label */ \
+	XX(EQ_LABEL, "=:")            \
+	XX(CMD_GROUP_START, "{")      \
+	XX(CMD_GROUP_END, "}")        \
+	XX(LABEL_SEP, ":")            \
+	XX(TEST, "test")              \
+	XX(EXPECT, "expect")          \
+	XX(NL, "\n")                  \
+	XX(EOF, "") /* must be the last */
+
+enum errClass { CONTINUE, TRACE, WARN, ERROR, FATAL };
+#define RED
+static const char *errClassStr[] = {"", "", "\033[95mwarning: \033[0m",
+							 "\033[91merror: \033[0m",
+							 "\033[91mfatal: \033[0m"};
+
+struct cmd {
+	const char *referencedLabel;
+	const char *label;
+	const char *dOpt[MAX_OPTIONS];
+	const char *dstName;
+	const char *assignType;
+	const char *sOpt[MAX_OPTIONS];
+	const char *srcName;
+	bool isUsed; // true if this slot, or any later, are defined
+	uint16_t cv; // the microcode Command Value
+	int line;	 // source line
+};
+// big enough for the text of any cmd
+#define CMD_TEXT_SIZE ((2 * MAX_OPTIONS + 4) * (MAX_TOKEN_LENGTH + 8))
+
+/* open addressing table of interned strings, keyed on (hash, len). Interned
+ * strings live as long as the context, so their text is allocated from blocks
+ * that are only freed with it.
+ */
+#define STR_BLOCK_SIZE (64 * 1024)
+struct strings {
+	const char *str;
+	int len;
+	unsigned hash;
+};
+struct strBlock {
+	struct strBlock *prev;
+	char text[];
+};
+struct internTable {
+	struct strings *slots;
+	int cap; // always a power of 2
+	int count;
+	struct strBlock *blocks; // most recent first
+	char *free;				 // the unused text of the most recent block
+	size_t freeLen;
+};
+
+struct symbols;
+typedef struct symbols *Symbol;
+
+struct symbols {
+	const char *id;
+	int value;
+	int gen; // generation that defined it, see specLog
+	int pos; // in the order of definition
+	uint64_t hash; // of the table up to and including it, see stateHash
+};
+
+/* The symbols, in the order they were defined, in an arena of fixed size
+ * blocks so they never move. A mark is a count of symbols; releasing back to
+ * it, as forget does, only lowers the count and the blocks are reused. The
+ * hash table keyed on the interned id indexes the arena. Entries for released
+ * symbols are left in it, ignored, until it is next rebuilt.
+ */
+#define SYM_BLOCK_SIZE 1024
+struct symTable {
+	const char *name; // "symbol" or "port", used in messages
+	Symbol *blocks;
+	int blockCnt;
+	int count;	   // symbols defined
+	Symbol *slots; // open addressing, linear probing; cap is a power of 2
+	int cap;
+	int used; // slots used by defined or released symbols
+	int low;  // the fewest defined since the input began, see saveSnapshot
+};
+
+// A symbol defined by a variant, the value it gets wherever it is defined
+struct override {
+	const char *id;
+	int value;
+};
+
+/* The keywords are interned by every context, as these strings, so they can be
+ * compared by address whichever context read them. They are kept in one table,
+ * so the address of an interned token also tells whether it is a keyword and
+ * which, see keywordOf().
+ */
+#define XX(name, str) K_##name,
+enum keyword { SYSTEM_TOKENS KEYWORD_CNT };
+#undef XX
+#define KEYWORD_SIZE 8 // the longest keyword and its NUL
+#define XX(name, str) str,
+static const char keywordText[KEYWORD_CNT][KEYWORD_SIZE] = {SYSTEM_TOKENS};
+#undef XX
+#define KW(name) keywordText[K_##name] // the keyword name
+
+// The keyword the interned token w is, or -1 if it is not one
+static int keywordOf(const char *w) {
+	uintptr_t off = (uintptr_t)w - (uintptr_t)keywordText;
+	return off < sizeof(keywordText) && off % KEYWORD_SIZE == 0
+			   ? (int)(off / KEYWORD_SIZE)
+			   : -1;
+}
+
+/* The source file being parsed. It is mapped, or if that fails read, whole
+ * into memory and lexed in place.
+ */
+struct source {
+	const char *buf;
+	const char *cur; // next character to lex
+	const char *end;
+	size_t mapLen;	 // length of the mapping, 0 if buf was not mapped
+	bool isBorrowed; // buf is the text of an input in memory
+};
+
+#define REG_SPECS (SET_BITS(7) + 1) // port specs that reg can declare
+
+/* The groups assembled from the file being parsed. They are committed to the
+ * image once the whole file has been parsed.
+ */
+struct grp {
+	int addr;
+	uint16_t cv[MAX_CMDS_PER_GRP]; // cmdsPerGrp of them
+	uint64_t key;	// in the group cache, 0 if not cacheable
+	bool isCached; // cv was copied from the group cache
+	int saved;	   // steps removed by the optimizer
+};
+
+/* An input and the trace setting it is parsed with */
+struct input {
+	const char *name;
+	const char *text; // the source of an input in memory, NULL for a file
+	size_t len;
+	bool trace;
+};
+
+/* Speculative parsing. With -j, inputs after the first are parsed by forked
+ * workers, each starting from the parser state at the time it was forked. A
+ * worker logs to specLog every lookup that reached state it inherited, every
+ * change it made to the symbol tables and the groups it assembled. The parent
+ * replays the logs in command line order against the real state. If a lookup
+ * gives a different result there, the worker's results are dropped and the
+ * file is parsed again serially, so the output matches a serial run.
+ */
+enum specOp {
+	SPEC_FIND,
+	SPEC_PUSH,
+	SPEC_FORGET,
+	SPEC_HEAD,
+	SPEC_CMDSET,
+	SPEC_PAGE,
+	SPEC_REGS,
+	SPEC_REG,
+	SPEC_GROUP,
+	SPEC_TEST,
+	SPEC_END
+};
+
+/* The group cache maps a key, derived from a group's normalised tokens and the
+ * values of the symbols and ports they name, to the command values assembled
+ * from them. It is loaded from and saved to path, keeping only the entries
+ * used by the run, so groups that have not changed are not parsed again.
+ */
+#define CACHE_MAGIC 0x4d434743 // "MCGC"
+struct cacheEntry {
+	uint64_t key; // 0 if the slot is empty
+	uint16_t cv[MAX_CMDS_PER_GRP];
+	int saved;
+	bool used;
+};
+struct groupCache {
+	const char *path; // NULL if caching is off
+	struct cacheEntry *slots;
+	int cap; // always a power of 2
+	int count;
+	int hits;
+	int misses;
+};
+
+/* --profile charges the time between calls of enterPhase to the phase being
+ * left, so each phase's time excludes the phases it calls. Timing is only done
+ * when profiling, so the cost when off is a test per phase change.
+ */
+enum phase {
+	PH_PARSE,
+	PH_LEX,
+	PH_INTERN,
+	PH_SYMBOLS,
+	PH_LABELS,
+	PH_OUTPUT,
+	PH_WAIT,
+	PHASE_CNT
+};
+static const char *phaseNames[PHASE_CNT] = {
+	"parse", "lex", "intern", "symbols", "labels", "output", "wait"};
+struct profile {
+	double secs[PHASE_CNT];
+	long internProbes;
+	long lookups;
+	long bytesWritten;
+};
+
+/* All the state of an assembly. Every function that reads or changes it is
+ * passed the context, so contexts on different threads don't interfere.
+ */
+struct mcasm_ctx {
+	FILE *diag;	   // where diagnostics go
+	jmp_buf fatal; // where a fatal error returns to
+	bool failed;   // after a fatal error
+	struct timespec start;
+	int tmpCnt; // temporary files created
+
+	struct internTable interned;
+	struct symTable symbols, ports;
+	struct source src;
+	const char *pushedWord; // the peeked word
+	const char *fileName;
+	int line;
+	int col;
+	int tokLine, tokCol; // where the last token lexed starts
+	bool trace;
+	bool parsing;
+	enum errClass baseClass; // of the message being printed
+	int exitStatus;
+	int errorCnt;
+
+	struct mcasm_geometry geo; // the bits of an address, see mcAddr
+	int cmdsPerGrp;
+	int storeSize;			 // commands in the image
+	uint16_t *image;		 // the microcode store being assembled
+	const char *outputName; // where image is written, NULL if not
+	FILE *listFile;				   // the listing, NULL if none
+	FILE *costFile;				   // the step counts of groups, NULL if none
+	FILE *mapFile;				   // the source of each step, NULL if none
+	enum mcasm_format outFormat;
+	bool lanes;				 // write the low and high bytes to separate files
+	const char *patchBase;	 // image a patch is written from, NULL if none
+	const char *snapshotDir; // NULL if not used
+
+	int cmdSet;	 // current command set
+	int page;	 // current command page
+	bool export; // true if exporting newly defined identifiers
+
+	struct grp *grps; // assembled from the file being parsed
+	int grpCnt, grpCap;
+	const char **grpOwner; // input of each grp, storeSize / cmdsPerGrp
+	struct input *inputs;
+	int inputCnt, inputCap;
+	int jobs; // max files parsed at once
+
+	FILE *specLog;	// the worker's log, NULL when not speculating
+	bool isVariant; // a forked process assembling a variant
+	struct override *overrides; // the symbols the variant defines
+	int overrideCnt;
+	int generation; // symbols from an earlier generation are inherited
+	bool cmdSetAssigned, pageAssigned, exportAssigned; // by the current file
+
+	char *tests; // the lines of the tests file of the output file
+	size_t testLen, testCap;
+
+	struct lsp *lsp; // the language server, NULL if not serving one
+
+	struct groupCache grpCache;
+	bool isKeyScan;	  // lexing a group for its cache key, see parseGrp
+	int keyScanErrs;  // errors the key scan met, not printed
+	bool stats;		// print statistics
+	long tokenCnt;	// tokens read
+	long groupCnt;	// groups assembled
+	bool optimize;	// run the peephole optimizer
+	bool isReg[REG_SPECS]; // port specs declared by reg
+	long stepsSaved;	   // by the optimizer
+	bool shareTails;	   // move tails shared by groups to groups of their own
+	long stepsReclaimed;   // by sharing tails
+
+	enum mcasm_profile profile;
+	struct profile prof;
+	enum phase phase;
+	struct timespec phaseStart;
+};
+
+// The microcode address of the first step of a command group
+static int mcAddr(const struct mcasm_ctx *ctx, int cmdSet, int page,
+				  int cmdId) {
+	return ((cmdSet << ctx->geo.pageBits | page) << ctx->geo.cmdBits | cmdId)
+		   << ctx->geo.stepBits;
+}
+
+static uint16_t prepend(uint16_t current, int len, int v) {
+	return (current << len) | (v & SET_BITS(len));
+}
+// Construct numeric representation of a source port command from its parts
+// dSpec and sSpec combine the option and port
+static uint16_t makePortCv(int dOpt, int dst, int tst, int sOpt, int src) {
+	uint16_t v = 0;
+	// Allow the dst and src to include options
+	uint16_t dSpec = ((dOpt & SET_BITS(4)) << 3) | (dst & SET_BITS(7));
+	uint16_t sSpec = ((sOpt & SET_BITS(4)) << 3) | (src & SET_BITS(7));
+	v = CMD_TYPE_PORT;
+	v = prepend(v, 7, dSpec);
+	v = prepend(v, 1, tst);
+	v = prepend(v, 7, sSpec);
+	return v;
+}
+// Construct numeric representation of an immediate command from its parts
+// dSpec and sSpec combine the option and port
+static uint16_t makeImmCv(int dOpt, int dst, int value) {
+	uint16_t v = 0;
+	// Allow the dst to include options
+	uint16_t dSpec = ((dOpt & SET_BITS(4)) << 3) | (dst & SET_BITS(7));
+	v = CMD_TYPE_IMM;
+	v = prepend(v, 7, dSpec);
+	v = prepend(v, 8, value);
+	return v;
+}
+/* set the source value for an immediate cmd from a label */
+static uint16_t labelCv(uint16_t cv, int label) {
+	return makeImmCv(cvDOpt(cv), cvDst(cv), label);
+}
+
+// Charge the time since the last phase change to the current phase
+static enum phase switchPhase(struct mcasm_ctx *ctx, enum phase p) {
+	enum phase prev = ctx->phase;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ctx->prof.secs[ctx->phase] += (now.tv_sec - ctx->phaseStart.tv_sec) +
+						(now.tv_nsec - ctx->phaseStart.tv_nsec) / 1e9;
+	ctx->phaseStart = now;
+	ctx->phase = p;
+	return prev;
+}
+
+// Switch to phase p, returning the phase left
+static inline enum phase enterPhase(struct mcasm_ctx *ctx, enum phase p) {
+	return ctx->profile ? switchPhase(ctx, p) : p;
+}
+
+/* The language server, --lsp, keeps each input in memory split into regions,
+ * each a statement and the blank lines and comments before it, with what
+ * parsing the region found: the symbols and ports it defined and named, its
+ * commands and its diagnostics. An edit is parsed from the start of the region
+ * it begins in, from the state the regions before leave, until it reaches an
+ * old region that starts from the same state it did, which is kept with those
+ * after it. Hover and go to definition are answered from the regions.
+ */
+static void print(struct mcasm_ctx *ctx, enum errClass class, const char *msg,
+				  ...);
+
+enum lspItemKind { LSP_DIAG, LSP_DEF, LSP_REF, LSP_FORGET, LSP_CMD, LSP_GROUP };
+struct lspItem {
+	enum lspItemKind kind;
+	int line, col, len; // the line from the region's first, col from 1
+	const char *text;	// the symbol, or the message of a diagnostic
+	int value; // of a symbol or command, the errClass of a diagnostic
+	int pos;   // of a symbol in its table, the symbols a forget left, the
+			   // address of a command or group
+	bool isPort;
+};
+struct lspRegion {
+	size_t offset; // of its first line
+	int line;
+	uint64_t state; // stateHash() before it
+	int symCnt, portCnt, cmdSet, page, export; // before it
+	bool hasStmt; // other than blank lines and comments
+	struct lspItem *items;
+	int itemCnt, itemCap;
+	int defCnt;	 // DEF and FORGET items, which lspRestore replays
+	int markCnt; // DIAG and GROUP items, which lspPublish reads
+};
+struct lspDoc {
+	char *name; // the input, or the path of a document opened
+	char *path; // real path, to match the documents opened, or NULL
+	char *uri;
+	char *text;
+	size_t len;
+	bool isInput;	  // given on the command line, not just opened
+	bool isPublished; // with the diagnostics hashed by published
+	uint64_t published;
+	int cmdSet, page, export; // at its end
+	struct lspRegion *regions;
+	int regionCnt, regionCap;
+};
+struct lspToken {
+	const char *word;
+	int line, col;
+};
+struct lsp {
+	FILE *out;
+	struct lspDoc *docs; // in the order they are assembled
+	int docCnt, docCap;
+	struct lspRegion cur;	   // being parsed
+	struct lspRegion *region;  // &cur while parsing, else NULL
+	struct lspToken tokens[4]; // the last lexed, most recent first
+	int tokenCnt;
+	int *owner; // doc + 1 of each command group, for conflicts
+	int parsed; // regions parsed
+	bool shutdown;
+};
+
+static void lspAddItem(struct mcasm_ctx *ctx, const struct lspItem *item) {
+	struct lspRegion *r = ctx->lsp->region;
+	if (r->itemCnt == r->itemCap) {
+		r->itemCap = r->itemCap ? r->itemCap * 2 : 8;
+		r->items = realloc(r->items, r->itemCap * sizeof(struct lspItem));
+		if (r->items == NULL)
+			print(ctx, FATAL, "Out of memory parsing %s\n", ctx->fileName);
+	}
+	r->items[r->itemCnt++] = *item;
+	r->defCnt += item->kind == LSP_DEF || item->kind == LSP_FORGET;
+	r->markCnt += item->kind == LSP_DIAG || item->kind == LSP_GROUP;
+}
+
+// Remember a token lexed, so items can be placed at the words they are about
+static void lspToken(struct mcasm_ctx *ctx, const char *word) {
+	struct lsp *l = ctx->lsp;
+	memmove(&l->tokens[1], &l->tokens[0],
+			(NELEMS(l->tokens) - 1) * sizeof(struct lspToken));
+	l->tokens[0].word = word;
+	l->tokens[0].line = ctx->tokLine;
+	l->tokens[0].col = ctx->tokCol;
+	if (l->tokenCnt < NELEMS(l->tokens))
+		l->tokenCnt++;
+}
+
+static int lspTokenLen(const char *word) {
+	return word == KW(NL) || word == KW(EOF) ? 0 : (int)strlen(word);
+}
+
+// Place item at the last word read, or at w if it was one of the last lexed
+static void lspPlace(struct mcasm_ctx *ctx, struct lspItem *item,
+					 const char *w) {
+	struct lsp *l = ctx->lsp;
+	const struct lspToken *t = NULL;
+	for (int i = 0; i < l->tokenCnt && w; i++)
+		if (l->tokens[i].word == w && t == NULL)
+			t = &l->tokens[i];
+	if (t == NULL && l->tokenCnt > (ctx->pushedWord != NULL))
+		t = &l->tokens[ctx->pushedWord != NULL];
+	item->line = t ? t->line - l->region->line : 0;
+	item->col = t ? t->col : 1;
+	item->len = t ? lspTokenLen(t->word) : 0;
+	if (item->line < 0)
+		item->line = 0, item->col = 1, item->len = 0;
+}
+
+/* Record a diagnostic, at the last word read up to the end of the word peeked
+ * after it, which between them are usually what it is about
+ */
+static void lspDiag(struct mcasm_ctx *ctx, const char *msg, va_list args) {
+	struct lsp *l = ctx->lsp;
+	struct lspItem item = {.kind = LSP_DIAG, .value = ctx->baseClass};
+	char *text;
+	va_list copy;
+	int len;
+	va_copy(copy, args);
+	len = vsnprintf(NULL, 0, msg, copy);
+	va_end(copy);
+	if ((text = malloc(len + 1)) == NULL)
+		print(ctx, FATAL, "Out of memory parsing %s\n", ctx->fileName);
+	vsprintf(text, msg, args);
+	while (len > 0 && text[len - 1] == '\n')
+		text[--len] = '\0';
+	item.text = text;
+	lspPlace(ctx, &item, NULL);
+	if (ctx->pushedWord && l->tokenCnt > 1 &&
+		l->tokens[0].line == l->tokens[1].line)
+		item.len = l->tokens[0].col + lspTokenLen(l->tokens[0].word) -
+				   l->tokens[1].col;
+	lspAddItem(ctx, &item);
+}
+
+// Record a definition of sym, if isDef, or a reference to it
+static void lspSymbol(struct mcasm_ctx *ctx, const struct symTable *t,
+					  Symbol sym, bool isDef) {
+	struct lspItem item = {.kind = isDef ? LSP_DEF : LSP_REF,
+						   .text = sym->id,
+						   .value = sym->value,
+						   .pos = sym->pos,
+						   .isPort = t == &ctx->ports};
+	lspPlace(ctx, &item, sym->id);
+	lspAddItem(ctx, &item);
+}
+
+// Record an item at w, or the last word read if NULL
+static void lspMark(struct mcasm_ctx *ctx, enum lspItemKind kind,
+					const char *w, int pos) {
+	struct lspItem item = {.kind = kind, .pos = pos};
+	lspPlace(ctx, &item, w);
+	lspAddItem(ctx, &item);
+}
+
+// Record a command, cv at address addr, on line
+static void lspCmd(struct mcasm_ctx *ctx, int line, int cv, int addr) {
+	struct lspItem item = {.kind = LSP_CMD, .value = cv, .pos = addr};
+	item.line = line - ctx->lsp->region->line;
+	item.col = 1;
+	lspAddItem(ctx, &item);
+}
+
+/* Print a diagnostic. A fatal error returns to the library function that was
+ * called, or ends a -j worker, whose input is then parsed again serially.
+ * While the language server parses, diagnostics are kept with the region.
+ * The scan for a group's cache key only counts its errors.
+ */
+static void print(struct mcasm_ctx *ctx, enum errClass class, const char *msg,
+				  ...) {
+	if (ctx->isKeyScan && class != FATAL) {
+		ctx->keyScanErrs += class == ERROR;
+		return;
+	}
+	if (class == ERROR || class == FATAL)
+		ctx->exitStatus = EXIT_FAILURE, ctx->errorCnt++;
+	if (class != CONTINUE)
+		ctx->baseClass = class;
+	va_list args;
+	if (ctx->lsp && ctx->lsp->region && ctx->baseClass != FATAL) {
+		if (ctx->baseClass != TRACE) {
+			va_start(args, msg);
+			lspDiag(ctx, msg, args);
+			va_end(args);
+		}
+		return;
+	}
+	if (ctx->baseClass == TRACE && !ctx->trace)
+		return;
+
+	if (class != CONTINUE) {
+		if (ctx->baseClass != TRACE && ctx->parsing)
+			fprintf(ctx->diag, "%s:%d:%d: ", ctx->fileName, ctx->line,
+					ctx->col);
+		fprintf(ctx->diag, "%s", errClassStr[ctx->baseClass]);
+	}
+
+	va_start(args, msg);
+	vfprintf(ctx->diag, msg, args);
+	va_end(args);
+	if (ctx->baseClass == FATAL) {
+		if (ctx->specLog || ctx->isVariant) {
+			fflush(ctx->diag);
+			_exit(EXIT_FAILURE);
+		}
+		ctx->failed = true, ctx->isKeyScan = false;
+		longjmp(ctx->fatal, 1);
+	}
+}
+
+// Append value to s, one bit per character of fmt, returning the end of s
+static char *formatBinary(struct mcasm_ctx *ctx, char *s, const char *fmt,
+						  int value) {
+	int bit = 1 << (strlen(fmt) - 1);
+	for (int c = 0; fmt[c]; c++, bit >>= 1) {
+		if (fmt[c] == '_')
+			*s++ = '_';
+		else if (fmt[c] != 'c')
+			print(ctx, FATAL, "Unexpected character, %c, in binary Format.",
+				  fmt[c]);
+		*s++ = value & bit ? '1' : '0';
+	}
+	*s = '\0';
+	return s;
+}
+
+static char *formatCmdVal(struct mcasm_ctx *ctx, char *s, uint16_t cv) {
+	// formats define one bit per character with
+	//  _ : print a bit preceeded by an underscore
+	//  c : print a bit
+	static const char *bit_format_imm = "c_ccc_cc_ccccccc";
+	static const char *bit_format_port = "c_ccc_cc__ccc_cc";
+	if (cvIsImm(cv)) {
+		s = formatBinary(ctx, s, bit_format_imm, cv);
+		return strcpy(s, "  ") + 2;
+	}
+	return formatBinary(ctx, s, bit_format_port, cv);
+}
+
+// Format the source of c with the values of its ports and options
+static void formatCmd(struct mcasm_ctx *ctx, char *s, const struct cmd *c) {
+	int optCnt = 0;
+	s += sprintf(s, c->label ? "  %s : %s" : "  %s  %s",
+				 c->label ? c->label : "", c->dstName);
+	for (optCnt = 0; optCnt < MAX_OPTIONS && c->dOpt[optCnt]; optCnt++)
+		s += sprintf(s, " , %s", c->dOpt[optCnt]);
+	s = formatBinary(ctx, strcpy(s, " [0b") + 4, "cccc_cc", cvDSpec(c->cv));
+	*s++ = ']';
+	if (cvIsImm(c->cv)) {
+		s += sprintf(s, "%s %s [%d]", c->assignType, c->srcName, cvImm(c->cv));
+	} else {
+		s += sprintf(s, "%s %s", c->assignType, c->srcName);
+		for (optCnt = 0; optCnt < MAX_OPTIONS && c->sOpt[optCnt]; optCnt++)
+			s += sprintf(s, " , %s", c->sOpt[optCnt]);
+		s = formatBinary(ctx, strcpy(s, " [0b") + 4, "cccc_cc", cvSSpec(c->cv));
+		*s++ = ']';
+	}
+	*s = '\0';
+	if (optCnt > 0)
+		sprintf(s, " [%d]", cvSOpt(c->cv));
+}
+
+static void printCmd(struct mcasm_ctx *ctx, const struct cmd *c) {
+	char val[32], text[CMD_TEXT_SIZE];
+	if (!c->isUsed)
+		return;
+	formatCmdVal(ctx, val, c->cv);
+	formatCmd(ctx, text, c);
+	print(ctx, TRACE, "<0x%4.4x / 0b%s>%s\n", c->cv, val, text);
+}
+
+// Write a command group to the listing
+static void listGroup(struct mcasm_ctx *ctx, const char *grpName, int addr,
+					  const struct cmd *cmds, int saved) {
+	char val[32], text[CMD_TEXT_SIZE];
+	int g = addr >> ctx->geo.stepBits;
+	fprintf(ctx->listFile, "\n; grp %s %d:%d:%d  %s", grpName,
+			g >> (ctx->geo.cmdBits + ctx->geo.pageBits),
+			(g >> ctx->geo.cmdBits) & SET_BITS(ctx->geo.pageBits),
+			g & SET_BITS(ctx->geo.cmdBits), ctx->fileName);
+	fprintf(ctx->listFile, saved ? "  %d steps saved\n" : "\n", saved);
+	for (int i = 0; i < ctx->cmdsPerGrp; i++) {
+		if (!cmds[i].isUsed)
+			continue;
+		formatCmdVal(ctx, val, cmds[i].cv);
+		formatCmd(ctx, text, &cmds[i]);
+		fprintf(ctx->listFile, "%4.4x  %4.4x  %s  %5d%s\n", addr + i,
+				cmds[i].cv, val, cmds[i].line, text);
+	}
+}
+
+// Write the group, label, line and input of each step of a group to the map
+static void mapGroup(struct mcasm_ctx *ctx, const char *grpName, int addr,
+					 const struct cmd *cmds) {
+	for (int i = 0; i < ctx->cmdsPerGrp; i++)
+		if (cmds[i].isUsed)
+			fprintf(ctx->mapFile, "%4.4x %s %s %d %s\n", addr + i, grpName,
+					cmds[i].label ? cmds[i].label : "-", cmds[i].line,
+					ctx->fileName);
+}
+
+// FNV-1a
+static unsigned hashStr(const char *s, int len) {
+	unsigned h = 2166136261u;
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+// FNV-1a of the len bytes at p, continuing from h
+static uint64_t hash64(uint64_t h, const void *p, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ ((const unsigned char *)p)[i]) * 0x100000001b3ull;
+	return h;
+}
+
+// interned strings are unique so their address is their identity
+static unsigned hashId(const char *id) {
+	uintptr_t p = (uintptr_t)id;
+	return (unsigned)((p >> 3) ^ (p >> 17)) * 2654435761u;
+}
+
+static void growInterned(struct mcasm_ctx *ctx) {
+	int oldCap = ctx->interned.cap;
+	struct strings *old = ctx->interned.slots;
+	ctx->interned.cap = oldCap ? oldCap * 2 : 1024;
+	ctx->interned.slots = calloc(ctx->interned.cap, sizeof(struct strings));
+	if (ctx->interned.slots == NULL)
+		print(ctx, FATAL, "Out of memory interning strings\n");
+	for (int i = 0; i < oldCap; i++) {
+		int j;
+		if (old[i].str == NULL)
+			continue;
+		for (j = old[i].hash & (ctx->interned.cap - 1);
+			 ctx->interned.slots[j].str; j = (j + 1) & (ctx->interned.cap - 1))
+			;
+		ctx->interned.slots[j] = old[i];
+	}
+	free(old);
+}
+
+// Add a keyword to the interned strings as itself
+static void internKeyword(struct mcasm_ctx *ctx, const char *keyword) {
+	int len = strlen(keyword);
+	unsigned hash = hashStr(keyword, len);
+	int i;
+	if (ctx->interned.count * 2 >= ctx->interned.cap)
+		growInterned(ctx);
+	for (i = hash & (ctx->interned.cap - 1); ctx->interned.slots[i].str;
+		 i = (i + 1) & (ctx->interned.cap - 1))
+		;
+	ctx->interned.slots[i].str = keyword;
+	ctx->interned.slots[i].len = len;
+	ctx->interned.slots[i].hash = hash;
+	ctx->interned.count++;
+}
+
+// Returns room for a string of len characters and its terminator
+static char *allocString(struct mcasm_ctx *ctx, int len) {
+	struct internTable *t = &ctx->interned;
+	char *s;
+	if ((size_t)len + 1 > t->freeLen) {
+		size_t size = len + 1 > STR_BLOCK_SIZE ? len + 1 : STR_BLOCK_SIZE;
+		struct strBlock *b = malloc(sizeof(struct strBlock) + size);
+		if (b == NULL)
+			print(ctx, FATAL, "Out of memory interning strings\n");
+		b->prev = t->blocks;
+		t->blocks = b;
+		t->free = b->text;
+		t->freeLen = size;
+	}
+	s = t->free;
+	t->free += len + 1;
+	t->freeLen -= len + 1;
+	return s;
+}
+
+/* intern a string */
+static const char *intern(struct mcasm_ctx *ctx, const char *s, int len) {
+	unsigned hash = hashStr(s, len);
+	enum phase prev = enterPhase(ctx, PH_INTERN);
+	int i;
+	if (ctx->interned.count * 2 >= ctx->interned.cap)
+		growInterned(ctx);
+	for (i = hash & (ctx->interned.cap - 1); ctx->interned.slots[i].str;
+		 i = (i + 1) & (ctx->interned.cap - 1)) {
+		struct strings *e = &ctx->interned.slots[i];
+		ctx->prof.internProbes++;
+		if (e->hash == hash && e->len == len && !memcmp(s, e->str, len)) {
+			enterPhase(ctx, prev);
+			return e->str;
+		}
+	}
+	{
+		char *newStr = allocString(ctx, len);
+		memcpy(newStr, s, len);
+		newStr[len] = '\0';
+		ctx->interned.slots[i].str = newStr;
+		ctx->interned.slots[i].len = len;
+		ctx->interned.slots[i].hash = hash;
+		ctx->interned.count++;
+		enterPhase(ctx, prev);
+		return newStr;
+	}
+}
+
+// The symbol defined pos'th, which may have been released
+static inline Symbol symbolAt(const struct symTable *t, int pos) {
+	return &t->blocks[pos / SYM_BLOCK_SIZE][pos % SYM_BLOCK_SIZE];
+}
+
+// The most recently defined symbol, or NULL if there are none
+static Symbol topSymbol(const struct symTable *t) {
+	return t->count ? symbolAt(t, t->count - 1) : NULL;
+}
+
+/* Returns the index slot for id; empty if id is not defined. A slot whose
+ * symbol was released, or reused for another id, is passed over.
+ */
+static Symbol *symbolSlot(struct symTable *t, const char *id) {
+	int i;
+	for (i = hashId(id) & (t->cap - 1);
+		 t->slots[i] && (t->slots[i]->id != id || t->slots[i]->pos >= t->count);
+		 i = (i + 1) & (t->cap - 1))
+		;
+	return &t->slots[i];
+}
+
+// Rebuild the index from the defined symbols, dropping released ones
+static void reindexSymbols(struct mcasm_ctx *ctx, struct symTable *t) {
+	if (t->cap == 0 || (t->count + 1) * 4 > t->cap) {
+		free(t->slots);
+		t->cap = t->cap ? t->cap * 2 : 256;
+		t->slots = malloc(t->cap * sizeof(Symbol));
+		if (t->slots == NULL)
+			print(ctx, FATAL, "Out of memory adding a %s\n", t->name);
+	}
+	memset(t->slots, 0, t->cap * sizeof(Symbol));
+	for (int i = 0; i < t->count; i++)
+		*symbolSlot(t, symbolAt(t, i)->id) = symbolAt(t, i);
+	t->used = t->count;
+}
+
+static void addSymbolBlock(struct mcasm_ctx *ctx, struct symTable *t) {
+	Symbol *blocks = realloc(t->blocks, (t->blockCnt + 1) * sizeof(Symbol));
+	if (blocks == NULL)
+		print(ctx, FATAL, "Out of memory adding a %s\n", t->name);
+	t->blocks = blocks;
+	blocks[t->blockCnt] = malloc(SYM_BLOCK_SIZE * sizeof(struct symbols));
+	if (blocks[t->blockCnt] == NULL)
+		print(ctx, FATAL, "Out of memory adding a %s\n", t->name);
+	t->blockCnt++;
+}
+
+static void freeSymTable(struct symTable *t) {
+	for (int i = 0; i < t->blockCnt; i++)
+		free(t->blocks[i]);
+	free(t->blocks);
+	free(t->slots);
+}
+
+// Release the symbols defined after mark, a count of symbols
+static void releaseSymbols(struct symTable *t, int mark) {
+	t->count = mark;
+	if (mark < t->low)
+		t->low = mark;
+}
+
+static void putInt(FILE *f, int v) {
+	fwrite(&v, sizeof(v), 1, f);
+}
+static void putStr(FILE *f, const char *s) {
+	int len = strlen(s);
+	putInt(f, len);
+	fwrite(s, 1, len, f);
+}
+static bool getInt(FILE *f, int *v) {
+	return fread(v, sizeof(*v), 1, f) == 1;
+}
+// Returns the interned string read from f, or NULL
+static const char *getStr(struct mcasm_ctx *ctx, FILE *f) {
+	int len;
+	char *buf;
+	const char *s = NULL;
+	if (!getInt(f, &len) || len < 0 || (buf = malloc(len + 1)) == NULL)
+		return NULL;
+	if (fread(buf, 1, len, f) == (size_t)len)
+		s = intern(ctx, buf, len);
+	free(buf);
+	return s;
+}
+
+// Returns Symbol if id is registered else NULL
+static Symbol findSymbol(struct mcasm_ctx *ctx, struct symTable *t,
+						 const char *id) {
+	Symbol sym = t->count == 0 ? NULL : *symbolSlot(t, id);
+	ctx->prof.lookups++;
+	if (ctx->specLog && (sym == NULL || sym->gen < ctx->generation)) {
+		putInt(ctx->specLog, SPEC_FIND);
+		putInt(ctx->specLog, t == &ctx->ports);
+		putStr(ctx->specLog, id);
+		putInt(ctx->specLog, sym != NULL);
+		putInt(ctx->specLog, sym ? sym->value : 0);
+	}
+	return sym;
+}
+
+static Symbol pushSymbol(struct mcasm_ctx *ctx, struct symTable *t,
+						 const char *id, int value) {
+	Symbol sym, *slot;
+	if ((t->used + 1) * 2 > t->cap)
+		reindexSymbols(ctx, t);
+	if (t->count == t->blockCnt * SYM_BLOCK_SIZE)
+		addSymbolBlock(ctx, t);
+	sym = symbolAt(t, t->count);
+	sym->hash = hash64(t->count ? symbolAt(t, t->count - 1)->hash
+								: 0xcbf29ce484222325ull,
+					   id, strlen(id) + 1);
+	sym->hash = hash64(sym->hash, &value, sizeof(value));
+	sym->id = id;
+	sym->value = value;
+	sym->gen = ctx->generation;
+	sym->pos = t->count++;
+	slot = symbolSlot(t, id);
+	t->used += *slot == NULL;
+	*slot = sym;
+	return sym;
+}
+
+static Symbol addSymbolToList(struct mcasm_ctx *ctx, struct symTable *t,
+							  const char *id, int value) {
+	Symbol sym = findSymbol(ctx, t, id);
+	if (sym == NULL) {
+		for (int i = 0; i < ctx->overrideCnt && t == &ctx->symbols; i++)
+			if (ctx->overrides[i].id == id)
+				value = ctx->overrides[i].value;
+		sym = pushSymbol(ctx, t, id, value);
+		if (ctx->specLog) {
+			putInt(ctx->specLog, SPEC_PUSH);
+			putInt(ctx->specLog, t == &ctx->ports);
+			putStr(ctx->specLog, id);
+			putInt(ctx->specLog, value);
+		}
+		print(ctx, TRACE, "added new %s: %s = %d\n", t->name, id, value);
+		if (ctx->lsp)
+			lspSymbol(ctx, t, sym, true);
+	} else if (ctx->lsp)
+		lspSymbol(ctx, t, sym, false);
+	return sym;
+}
+static Symbol addSymbol(struct mcasm_ctx *ctx, const char *id, int value) {
+	return addSymbolToList(ctx, &ctx->symbols, id, value);
+}
+static Symbol addPort(struct mcasm_ctx *ctx, const char *id, int value) {
+	return addSymbolToList(ctx, &ctx->ports, id, value);
+}
+
+/* The lexer classifies each byte with one load from charClass and recognizes
+ * the operators with the DFA in transitions, in the same pass that finds the
+ * end of a token. Tokens are still runs of graphic characters, isgraph() in the
+ * C locale, so an operator followed by more of them is a word.
+ */
+enum charClass {
+	C_SPACE, // and any other byte that is not part of a token
+	C_NL,
+	C_WORD,
+	C_EQ,	 // =
+	C_TEST,	 // ?
+	C_IMM,	 // #
+	C_COLON, // :
+	C_SEMI,	 // ;
+	C_OPEN,	 // {
+	C_CLOSE, // }
+	CLASS_CNT
+};
+#define CHAR_CLASS(c)                                                        \
+	((c) == '\n'	 ? C_NL                                                  \
+	 : (c) == '='	 ? C_EQ                                                  \
+	 : (c) == '?'	 ? C_TEST                                                \
+	 : (c) == '#'	 ? C_IMM                                                 \
+	 : (c) == ':'	 ? C_COLON                                               \
+	 : (c) == ';'	 ? C_SEMI                                                \
+	 : (c) == '{'	 ? C_OPEN                                                \
+	 : (c) == '}'	 ? C_CLOSE                                               \
+	 : (c) > ' ' && (c) < 0x7f ? C_WORD                                  \
+							   : C_SPACE)
+#define CHAR_CLASS4(c)                                                       \
+	CHAR_CLASS(c), CHAR_CLASS((c) + 1), CHAR_CLASS((c) + 2),                 \
+		CHAR_CLASS((c) + 3)
+#define CHAR_CLASS16(c)                                                      \
+	CHAR_CLASS4(c), CHAR_CLASS4((c) + 4), CHAR_CLASS4((c) + 8),              \
+		CHAR_CLASS4((c) + 12)
+#define CHAR_CLASS64(c)                                                      \
+	CHAR_CLASS16(c), CHAR_CLASS16((c) + 16), CHAR_CLASS16((c) + 32),         \
+		CHAR_CLASS16((c) + 48)
+static const unsigned char charClass[256] = {
+	CHAR_CLASS64(0), CHAR_CLASS64(64), CHAR_CLASS64(128), CHAR_CLASS64(192)};
+
+// States of the DFA; those after S_WORD have read an operator
+enum lexState {
+	S_END, // the token has ended
+	S_START,
+	S_WORD,
+	S_EQ,
+	S_EQ_TEST,
+	S_EQ_IMM,
+	S_EQ_LABEL,
+	S_LABEL_SEP,
+	S_COMMENT,
+	S_GROUP_START,
+	S_GROUP_END,
+	STATE_CNT
+};
+#define WORD_ROW                                                             \
+	{S_END, S_END, S_WORD, S_WORD, S_WORD, S_WORD, S_WORD, S_WORD, S_WORD,   \
+	 S_WORD}
+static const unsigned char transitions[STATE_CNT][CLASS_CNT] = {
+	[S_START] = {S_END, S_END, S_WORD, S_EQ, S_WORD, S_WORD, S_LABEL_SEP,
+				 S_COMMENT, S_GROUP_START, S_GROUP_END},
+	[S_WORD] = WORD_ROW,
+	[S_EQ] = {S_END, S_END, S_WORD, S_WORD, S_EQ_TEST, S_EQ_IMM, S_EQ_LABEL,
+			  S_WORD, S_WORD, S_WORD},
+	[S_EQ_TEST] = WORD_ROW,
+	[S_EQ_IMM] = WORD_ROW,
+	[S_EQ_LABEL] = WORD_ROW,
+	[S_LABEL_SEP] = WORD_ROW,
+	[S_COMMENT] = WORD_ROW,
+	[S_GROUP_START] = WORD_ROW,
+	[S_GROUP_END] = WORD_ROW,
+};
+// the operator each accepting state read
+static const unsigned char operators[STATE_CNT] = {
+	[S_EQ] = K_EQ,
+	[S_EQ_TEST] = K_EQ_TEST,
+	[S_EQ_IMM] = K_EQ_IMM,
+	[S_EQ_LABEL] = K_EQ_LABEL,
+	[S_LABEL_SEP] = K_LABEL_SEP,
+	[S_COMMENT] = K_COMMENT_START,
+	[S_GROUP_START] = K_CMD_GROUP_START,
+	[S_GROUP_END] = K_CMD_GROUP_END,
+};
+
+// Skips anything that is not part of a token, a newline or the end of file
+static void skipInsignificantCharacters(struct mcasm_ctx *ctx) {
+	const char *p = ctx->src.cur;
+	while (p < ctx->src.end && charClass[(unsigned char)*p] == C_SPACE)
+		p++;
+	ctx->col += p - ctx->src.cur;
+	ctx->src.cur = p;
+}
+// Returns the next interned token.
+// A token is a newline, eof or sequence of isgraph() characters.
+static const char *lexToken(struct mcasm_ctx *ctx) {
+	const char *start, *p, *end = ctx->src.end;
+	int len, state, next;
+	skipInsignificantCharacters(ctx);
+	ctx->tokLine = ctx->line, ctx->tokCol = ctx->col;
+	if (ctx->src.cur >= end) {
+		ctx->col++;
+		return KW(EOF);
+	}
+	if (*ctx->src.cur == '\n') {
+		ctx->src.cur++;
+		ctx->col = 1, ctx->line++;
+		ctx->tokenCnt++;
+		return KW(NL);
+	}
+	ctx->tokenCnt++;
+	start = p = ctx->src.cur;
+	for (state = S_START; p < end; p++, state = next)
+		if ((next = transitions[state][charClass[(unsigned char)*p]]) == S_END)
+			break;
+	ctx->src.cur = p;
+	len = p - start;
+	ctx->col += len;
+	if (state > S_WORD) // operators are keywords, so need not be interned
+		return keywordText[operators[state]];
+	if (len > MAX_TOKEN_LENGTH) {
+		print(ctx, ERROR, "Length of token, %.*s, exceeds the maximum, %d\n",
+			  len, start, MAX_TOKEN_LENGTH);
+		len = MAX_TOKEN_LENGTH;
+	}
+	return intern(ctx, start, len);
+}
+
+static const char *readToken(struct mcasm_ctx *ctx) {
+	enum phase prev = enterPhase(ctx, PH_LEX);
+	const char *token = lexToken(ctx);
+	enterPhase(ctx, prev);
+	return token;
+}
+static void skipComment(struct mcasm_ctx *ctx) {
+	const char *nl = memchr(ctx->src.cur, '\n', ctx->src.end - ctx->src.cur);
+	if (nl == NULL)
+		nl = ctx->src.end;
+	ctx->col += nl - ctx->src.cur;
+	ctx->src.cur = nl;
+}
+static bool tokenIsLineTerm(const char *t) {
+	return t == KW(NL) || t == KW(EOF);
+}
+// Get the next word from src as a pointer to an interned string.
+// Skip whitespace and comments.
+#define readWord() readOrPeekWord(ctx, false)
+#define peekWord() readOrPeekWord(ctx, true)
+// Reads a Token but never returns a comment token. Instead it skips comments
+// and returns the line termination (NL or EOF). The caller either needs one
+// or the caller will ignore as an empty line
+static const char *readOrPeekWord(struct mcasm_ctx *ctx, bool peek) {
+	const char *word = ctx->pushedWord;
+
+	if (word == NULL) {
+		word = readToken(ctx);
+		if (word == KW(COMMENT_START)) {
+			skipComment(ctx);
+			word = readToken(ctx);
+			assert(tokenIsLineTerm(word) &&
+				   "How did we fail to read a line termination");
+		}
+		if (ctx->lsp)
+			lspToken(ctx, word);
+	}
+	ctx->pushedWord = peek ? word : NULL;
+	return word;
+}
+
+static bool skipWordIf(struct mcasm_ctx *ctx, const char *w) {
+	if (peekWord() != w)
+		return false;
+	readWord();
+	return true;
+}
+
+static void expectLineEnd(struct mcasm_ctx *ctx) {
+	if (!skipWordIf(ctx, KW(NL))) {
+		print(ctx, ERROR, "Expected new line\n");
+		for (const char *word = readWord(); !tokenIsLineTerm(word);
+			 word = readWord())
+			;
+	}
+}
+
+static void parseExport(struct mcasm_ctx *ctx) {
+	const char *state;
+	state = readWord();
+	if (state != KW(ON) && state != KW(OFF)) {
+		print(ctx, ERROR, "expected on or off for new export state\n");
+		return;
+	}
+	expectLineEnd(ctx);
+	ctx->export = state == KW(ON);
+	ctx->exportAssigned = true;
+	print(ctx, TRACE, "export set to %d\n", ctx->export);
+}
+
+// If id is an identifier set value to its value and return true
+static bool resolveIdentifier(struct mcasm_ctx *ctx, struct symTable *t,
+							  const char *id, int *value) {
+	Symbol sym = findSymbol(ctx, t, id);
+	*value = sym ? sym->value : -1;
+	if (sym && ctx->lsp)
+		lspSymbol(ctx, t, sym, false);
+	return sym != NULL;
+}
+
+// Extract a binary integer from a string. Allows _ digit separator, does not
+// allow preceding 0b.
+// On return, sNxt points to the first character of s that is not consumed.
+static long binStrToL(const char *str, char **sNxt) {
+	long result = 0;
+	char *c = (char *)str;
+	while (*c == '0' || *c == '1' || *c == '_') {
+		if (*c != '_') {
+			result = result * 2 + (*c == '0' ? 0 : 1);
+		}
+		c++;
+	}
+	*sNxt = c;
+	return result;
+}
+
+/* Attempts to resolve s as a symbol name and if found returns that symbol's
+ *  value.
+ *  Otherwise, treats s as the string representation of a hex, binary or decimal
+ *  number, parses that number and returns that as the value.
+ */
+static int deriveSymbolValueFromList(struct mcasm_ctx *ctx, struct symTable *t,
+									 const char *s) {
+	char *sNxt;
+	int result = 0;
+	enum phase prev = enterPhase(ctx, PH_SYMBOLS);
+	if (resolveIdentifier(ctx, t, s, &result)) {
+		enterPhase(ctx, prev);
+		return result;
+	}
+	if (s[0] == '0' && s[1] == 'x') {
+		result = strtol(s, &sNxt, 16);
+	} else if (s[0] == '0' && s[1] == 'b') {
+		result = binStrToL(&s[2], &sNxt);
+	} else {
+		result = strtol(s, &sNxt, 10);
+	}
+	if (sNxt[0] != '\0') {
+		print(ctx, ERROR, "error deriving value for %s %s\n", t->name, s);
+		result = -1;
+	}
+	enterPhase(ctx, prev);
+	return result;
+}
+static int deriveSymbolValue(struct mcasm_ctx *ctx, const char *s) {
+	return deriveSymbolValueFromList(ctx, &ctx->symbols, s);
+}
+static int derivePortValue(struct mcasm_ctx *ctx, const char *s) {
+	return deriveSymbolValueFromList(ctx, &ctx->ports, s);
+}
+static void parseDef(struct mcasm_ctx *ctx) {
+	const char *id = readWord();
+	int value = -1;
+	if (tokenIsLineTerm(id)) {
+		print(ctx, ERROR, "No symbol defined\n");
+		return;
+	}
+	if (tokenIsLineTerm(peekWord())) {
+		print(ctx, ERROR, "No value for symbol %s\n", id);
+	} else {
+		const char *valStr = readWord();
+		value = deriveSymbolValue(ctx, valStr);
+	}
+	addSymbol(ctx, id, value);
+	expectLineEnd(ctx);
+}
+static void parseSet(struct mcasm_ctx *ctx, bool zeroInit) {
+	const char *word;
+	Symbol top = topSymbol(&ctx->symbols);
+	int lastVal = zeroInit || top == NULL ? 0 : top->value + 1;
+	if (ctx->specLog && !zeroInit &&
+		(top == NULL || top->gen < ctx->generation)) {
+		putInt(ctx->specLog, SPEC_HEAD);
+		putInt(ctx->specLog, top != NULL);
+		putInt(ctx->specLog, lastVal);
+	}
+	for (word = readWord(); !tokenIsLineTerm(word); word = readWord()) {
+		addSymbol(ctx, word, lastVal);
+		lastVal++;
+	}
+}
+
+static void parsePort(struct mcasm_ctx *ctx) {
+	const char *id = readWord();
+	int value = -1;
+	if (tokenIsLineTerm(id)) {
+		print(ctx, ERROR, "No port defined\n");
+		return;
+	}
+	if (tokenIsLineTerm(peekWord()))
+		print(ctx, ERROR, "No value for port %s\n", id);
+	else {
+		const char *valStr = readWord();
+		value = derivePortValue(ctx, valStr);
+	}
+	addPort(ctx, id, value);
+	expectLineEnd(ctx);
+}
+
+/* Forget symbols back to, but not including, forgetTo or all if NULL or not
+ * defined, returning how many were forgotten. They stay in the arena, after
+ * the symbols defined, until more are defined.
+ */
+static int forgetSymbols(struct mcasm_ctx *ctx, const char *forgetTo) {
+	struct symTable *t = &ctx->symbols;
+	Symbol sym = forgetTo && t->count ? *symbolSlot(t, forgetTo) : NULL;
+	int count = t->count;
+	releaseSymbols(t, sym ? sym->pos + 1 : 0);
+	return count - t->count;
+}
+
+static void parseForget(struct mcasm_ctx *ctx) {
+	const char *forgetTo = readWord();
+	int forgetCnt;
+	if (tokenIsLineTerm(forgetTo)) {
+		forgetTo = NULL;
+		print(ctx, TRACE, "Forgetting all\n");
+	} else {
+		expectLineEnd(ctx);
+	}
+	forgetCnt = forgetSymbols(ctx, forgetTo);
+	if (ctx->lsp)
+		lspMark(ctx, LSP_FORGET, NULL, ctx->symbols.count);
+	if (ctx->specLog) {
+		putInt(ctx->specLog, SPEC_FORGET);
+		putInt(ctx->specLog, forgetTo != NULL);
+		putStr(ctx->specLog, forgetTo ? forgetTo : "");
+		// the count only matters when it is reported
+		putInt(ctx->specLog, ctx->trace || (forgetTo && !ctx->symbols.count)
+								 ? forgetCnt
+								 : -1);
+		putInt(ctx->specLog, ctx->symbols.count != 0);
+	}
+	if (forgetTo != NULL && ctx->symbols.count == 0) {
+		print(ctx, ERROR, "Failed to find %s so forgot all %d symbols\n",
+			  forgetTo, forgetCnt);
+	} else if (ctx->symbols.count == 0) {
+		print(ctx, TRACE, "Forgot all %d symbols\n", forgetCnt);
+	} else
+		print(ctx, TRACE, "Forgot %d symbols to %s\n", forgetCnt, forgetTo);
+}
+static void parseCmdSet(struct mcasm_ctx *ctx) {
+	int maxCmdSet = SET_BITS(ctx->geo.cmdSetBits);
+	ctx->cmdSet = deriveSymbolValue(ctx, readWord());
+	ctx->cmdSetAssigned = true;
+	print(ctx, TRACE, "cmdSet is:%d\n", ctx->cmdSet);
+	if (ctx->cmdSet > maxCmdSet || ctx->cmdSet < 0) {
+		print(ctx, ERROR, "Command Set, %d, is out of range 0..%d\n",
+			  ctx->cmdSet, maxCmdSet);
+		ctx->cmdSet = 0;
+	}
+	expectLineEnd(ctx);
+}
+
+static void parsePage(struct mcasm_ctx *ctx) {
+	int maxPage = SET_BITS(ctx->geo.pageBits);
+	ctx->page = deriveSymbolValue(ctx, readWord());
+	ctx->pageAssigned = true;
+	print(ctx, TRACE, "page is:%d\n", ctx->page);
+	if (ctx->page > maxPage || ctx->page < 0) {
+		print(ctx, ERROR, "Page, %d, is out of range 0..%d\n", ctx->page,
+			  maxPage);
+		ctx->page = 0;
+	}
+	expectLineEnd(ctx);
+}
+static bool peekWordIsAssignment(struct mcasm_ctx *ctx) {
+	const char *nxtWord = peekWord();
+	return (nxtWord == KW(EQ) || nxtWord == KW(EQ_IMM) ||
+			nxtWord == KW(EQ_LABEL) || nxtWord == KW(EQ_TEST));
+}
+
+// The source and destination are constructed from a sequence of
+// words. The first word is assumed to be a port but can also include
+// options. It is thus allowed to be 7 bits long. The subsequent words,
+// if any, are options. Options are ordered together and will be shifted
+// right by 3 bits when the command value is constructed
+static void parseCmd(struct mcasm_ctx *ctx, struct cmd *c) {
+	int dOpt = 0, sOpt = 0, tst = 0, src = 0, dst = 0;
+	int optCnt;
+	c->isUsed = true;
+	c->line = ctx->line;
+	c->dstName = readWord(); // assume no label
+
+	if (skipWordIf(ctx, KW(LABEL_SEP))) {
+		c->label = c->dstName;
+		c->dstName = readWord();
+	}
+	dst = derivePortValue(ctx, c->dstName);
+
+	for (optCnt = 0, dOpt = 0;
+		 !peekWordIsAssignment(ctx) && optCnt < MAX_OPTIONS; optCnt++) {
+		c->dOpt[optCnt] = readWord();
+		dOpt |= derivePortValue(ctx, c->dOpt[optCnt]);
+	}
+	if (!peekWordIsAssignment(ctx))
+		print(ctx, ERROR, "Unexpected assignment type; max options %d\n",
+			  MAX_OPTIONS);
+	c->assignType = readWord();
+
+	c->srcName = readWord();
+	if (c->assignType == KW(EQ_IMM)) {
+		src = deriveSymbolValue(ctx, c->srcName);
+		c->cv = makeImmCv(dOpt, dst, src);
+	} else if (c->assignType == KW(EQ_LABEL)) {
+		c->cv = makeImmCv(dOpt, dst, 0); // resolve src value later
+		c->referencedLabel = c->srcName;
+	} else {
+		src = derivePortValue(ctx, c->srcName);
+		for (optCnt = 0, sOpt = 0;
+			 !tokenIsLineTerm(peekWord()) && optCnt < MAX_OPTIONS; optCnt++) {
+			c->sOpt[optCnt] = readWord();
+			sOpt |= derivePortValue(ctx, c->sOpt[optCnt]);
+		}
+		if (optCnt > MAX_OPTIONS)
+			print(ctx, ERROR, "Too many options, max %d\n", MAX_OPTIONS);
+		tst = c->assignType == KW(EQ_TEST) ? CMD_TST : CMD_NO_TST;
+		c->cv = makePortCv(dOpt, dst, tst, sOpt, src);
+	}
+	expectLineEnd(ctx);
+	return;
+}
+
+// Build stamp, so cached results from another build of mcasm are not used
+static uint64_t buildStamp() {
+	static const char stamp[] = __DATE__ " " __TIME__;
+	return hash64(0xcbf29ce484222325ull, stamp, sizeof(stamp));
+}
+
+// The build stamp and geometry, which saved groups and states depend on
+static uint64_t configStamp(const struct mcasm_ctx *ctx) {
+	return hash64(buildStamp(), &ctx->geo, sizeof(ctx->geo));
+}
+
+static struct cacheEntry *cacheSlot(struct mcasm_ctx *ctx, uint64_t key) {
+	int i;
+	for (i = key & (ctx->grpCache.cap - 1);
+		 ctx->grpCache.slots[i].key && ctx->grpCache.slots[i].key != key;
+		 i = (i + 1) & (ctx->grpCache.cap - 1))
+		;
+	return &ctx->grpCache.slots[i];
+}
+
+static struct cacheEntry *findCached(struct mcasm_ctx *ctx, uint64_t key) {
+	struct cacheEntry *e;
+	if (ctx->grpCache.count == 0)
+		return NULL;
+	e = cacheSlot(ctx, key);
+	return e->key ? e : NULL;
+}
+
+static void addCached(struct mcasm_ctx *ctx, uint64_t key, const uint16_t *cv,
+					  int saved) {
+	struct cacheEntry *e;
+	if (ctx->grpCache.count * 2 >= ctx->grpCache.cap) {
+		struct cacheEntry *old = ctx->grpCache.slots;
+		int oldCap = ctx->grpCache.cap;
+		ctx->grpCache.cap = oldCap ? oldCap * 2 : 1024;
+		ctx->grpCache.slots =
+			calloc(ctx->grpCache.cap, sizeof(struct cacheEntry));
+		if (ctx->grpCache.slots == NULL)
+			print(ctx, FATAL, "Out of memory caching command groups\n");
+		for (int i = 0; i < oldCap; i++)
+			if (old[i].key)
+				*cacheSlot(ctx, old[i].key) = old[i];
+		free(old);
+	}
+	e = cacheSlot(ctx, key);
+	if (e->key == 0)
+		ctx->grpCache.count++;
+	e->key = key;
+	memcpy(e->cv, cv, ctx->cmdsPerGrp * sizeof(uint16_t));
+	e->saved = saved;
+	e->used = true;
+}
+
+// Load the group cache, ignoring it if it is missing or from another build
+static void loadGroupCache(struct mcasm_ctx *ctx) {
+	FILE *f = fopen(ctx->grpCache.path, "rb");
+	uint64_t stamp, key;
+	uint16_t cv[MAX_CMDS_PER_GRP];
+	int magic, saved;
+	if (f == NULL)
+		return;
+	if (getInt(f, &magic) && magic == CACHE_MAGIC &&
+		fread(&stamp, sizeof(stamp), 1, f) == 1 && stamp == configStamp(ctx))
+		while (fread(&key, sizeof(key), 1, f) == 1 &&
+			   fread(cv, sizeof(uint16_t), ctx->cmdsPerGrp, f) ==
+				   (size_t)ctx->cmdsPerGrp &&
+			   getInt(f, &saved)) {
+			addCached(ctx, key, cv, saved);
+			cacheSlot(ctx, key)->used = false;
+		}
+	fclose(f);
+}
+
+// Save the entries of the group cache used by this run
+static void saveGroupCache(struct mcasm_ctx *ctx) {
+	char *tmpName = malloc(strlen(ctx->grpCache.path) + sizeof(".XXXXXX"));
+	uint64_t stamp = configStamp(ctx);
+	int fd;
+	FILE *f;
+	sprintf(tmpName, "%s.XXXXXX", ctx->grpCache.path);
+	if ((fd = mkstemp(tmpName)) < 0 || (f = fdopen(fd, "wb")) == NULL) {
+		print(ctx, WARN, "Can't write the group cache %s\n",
+			  ctx->grpCache.path);
+		free(tmpName);
+		return;
+	}
+	putInt(f, CACHE_MAGIC);
+	fwrite(&stamp, sizeof(stamp), 1, f);
+	for (int i = 0; i < ctx->grpCache.cap; i++)
+		if (ctx->grpCache.slots[i].key && ctx->grpCache.slots[i].used) {
+			fwrite(&ctx->grpCache.slots[i].key, sizeof(uint64_t), 1, f);
+			fwrite(ctx->grpCache.slots[i].cv, sizeof(uint16_t), ctx->cmdsPerGrp,
+				   f);
+			putInt(f, ctx->grpCache.slots[i].saved);
+		}
+	if (fclose(f) != 0 || rename(tmpName, ctx->grpCache.path) != 0) {
+		print(ctx, WARN, "Can't write the group cache %s\n",
+			  ctx->grpCache.path);
+		unlink(tmpName);
+	}
+	free(tmpName);
+}
+
+// Add a group to those assembled from the current file
+static struct grp *addGroup(struct mcasm_ctx *ctx, int addr) {
+	if (ctx->grpCnt == ctx->grpCap) {
+		ctx->grpCap = ctx->grpCap ? ctx->grpCap * 2 : 64;
+		ctx->grps = realloc(ctx->grps, ctx->grpCap * sizeof(struct grp));
+		if (ctx->grps == NULL)
+			print(ctx, FATAL, "Out of memory adding a command group\n");
+	}
+	ctx->grps[ctx->grpCnt].addr = addr;
+	ctx->grps[ctx->grpCnt].key = 0;
+	ctx->grps[ctx->grpCnt].isCached = false;
+	ctx->grps[ctx->grpCnt].saved = 0;
+	return &ctx->grps[ctx->grpCnt++];
+}
+
+// Copy the groups assembled from input into the image
+static void commitGroups(struct mcasm_ctx *ctx, const char *input) {
+	for (int i = 0; i < ctx->grpCnt; i++) {
+		int g = ctx->grps[i].addr / ctx->cmdsPerGrp;
+		if (ctx->grpOwner[g] && ctx->grpOwner[g] != input)
+			print(ctx, ERROR,
+				  "Command group %d:%d:%d in %s conflicts with the group "
+				  "in %s\n",
+				  g >> (ctx->geo.pageBits + ctx->geo.cmdBits),
+				  (g >> ctx->geo.cmdBits) & SET_BITS(ctx->geo.pageBits),
+				  g & SET_BITS(ctx->geo.cmdBits), input, ctx->grpOwner[g]);
+		ctx->grpOwner[g] = input;
+		ctx->groupCnt++;
+		ctx->stepsSaved += ctx->grps[i].saved;
+		memcpy(&ctx->image[ctx->grps[i].addr], ctx->grps[i].cv,
+			   ctx->cmdsPerGrp * sizeof(uint16_t));
+		if (!ctx->grpCache.path)
+			continue;
+		if (ctx->grps[i].isCached)
+			ctx->grpCache.hits++;
+		else
+			ctx->grpCache.misses++;
+		if (ctx->grps[i].key)
+			addCached(ctx, ctx->grps[i].key, ctx->grps[i].cv,
+					  ctx->grps[i].saved);
+	}
+	ctx->grpCnt = 0;
+}
+
+static uint64_t hashLookup(struct mcasm_ctx *ctx, uint64_t h,
+						   struct symTable *t, const char *id) {
+	Symbol sym = findSymbol(ctx, t, id);
+	int v = sym ? sym->value : -1;
+	h = hash64(h, &v, sizeof(v));
+	return hash64(h, "", sym != NULL);
+}
+
+// Read the rest of a group, from its id to its closing }, and return its
+// cache key. Blank lines and comments do not change the key.
+static uint64_t groupKey(struct mcasm_ctx *ctx) {
+	uint64_t h = buildStamp();
+	if (ctx->optimize)
+		h = hash64(h, ctx->isReg, sizeof(ctx->isReg));
+	const char *prev = NULL;
+	for (const char *w = readWord(); w != KW(EOF); prev = w, w = readWord()) {
+		if (w == KW(NL) && prev == KW(NL))
+			continue;
+		h = hash64(h, w, strlen(w) + 1);
+		h = hashLookup(ctx, h, &ctx->symbols, w);
+		h = hashLookup(ctx, h, &ctx->ports, w);
+		if (w == KW(CMD_GROUP_END))
+			return h ? h : 1;
+	}
+	return 0;
+}
+
+// Returns the address of cmdId in the current cmdSet and page
+static int grpAddr(struct mcasm_ctx *ctx, int cmdId) {
+	if (ctx->specLog && !ctx->cmdSetAssigned) {
+		putInt(ctx->specLog, SPEC_CMDSET);
+		putInt(ctx->specLog, ctx->cmdSet);
+	}
+	if (ctx->specLog && !ctx->pageAssigned) {
+		putInt(ctx->specLog, SPEC_PAGE);
+		putInt(ctx->specLog, ctx->page);
+	}
+	return MC_ADDR(cmdId);
+}
+
+static bool isUncond(uint16_t cv) {
+	return cvIsImm(cv) || cvTst(cv) == CMD_NO_TST;
+}
+static bool isBranch(uint16_t cv) {
+	return cvDst(cv) == MCC_PORT && (cvDOpt(cv) & MCC_BRCH);
+}
+// false if cv always leaves the step sequence, by a jmp or a branch
+static bool fallsThrough(uint16_t cv) {
+	return cvDst(cv) != MCC_PORT || !isUncond(cv) ||
+		   (cvDOpt(cv) & 3) == MCC_CNDBRCH;
+}
+
+/* Returns true if the value step i writes is overwritten, by the following
+ * steps, before it is read or the step sequence can change
+ */
+static bool isDeadWrite(struct mcasm_ctx *ctx, const struct cmd *cmds,
+						const bool *keep, int n, int i) {
+	uint16_t cv = cmds[i].cv;
+	if (cvDst(cv) == MCC_PORT || !ctx->isReg[cvDSpec(cv)] ||
+		!(cvIsImm(cv) || ctx->isReg[cvSSpec(cv)]))
+		return false;
+	for (int k = i + 1; k < n; k++) {
+		uint16_t next = cmds[k].cv;
+		if (!keep[k])
+			continue;
+		if ((!cvIsImm(next) && cvSrc(next) == cvDst(cv)) ||
+			cvDst(next) == MCC_PORT)
+			return false;
+		if (cvDst(next) == cvDst(cv))
+			return cvDSpec(next) == cvDSpec(cv) && isUncond(next);
+	}
+	return false;
+}
+
+/* Peephole optimizer, run on a group once its labels are resolved. It removes
+ * steps that can't be reached and writes to registers, declared by reg, that
+ * are overwritten before being read, and folds an immediate load of a register
+ * into a following copy of it. A jmp can enter a group half way, at step 8 of
+ * 16, as well as at 0, so the two halves are closed up separately, and
+ * references to steps, by labels and branches, are retargeted. Returns the
+ * steps removed.
+ */
+static int optimizeGroup(struct mcasm_ctx *ctx, struct cmd *cmds) {
+	const int size = ctx->cmdsPerGrp, half = size / 2;
+	const int stepMask = SET_BITS(ctx->geo.stepBits);
+	bool keep[MAX_CMDS_PER_GRP] = {false}, changed;
+	int todo[MAX_CMDS_PER_GRP], todoCnt = 0, map[MAX_CMDS_PER_GRP];
+	struct cmd closed[MAX_CMDS_PER_GRP];
+	int n, i, kept, last, next;
+	for (n = 0; n < size && cmds[n].isUsed; n++)
+		;
+	if (n == 0)
+		return 0;
+	for (i = 0; i < n; i++) // a computed branch can reach any step
+		if (isBranch(cmds[i].cv) && !cvIsImm(cmds[i].cv))
+			return 0;
+
+	// mark the steps that can be reached
+	for (i = 0; i < n; i += half)
+		keep[i] = true, todo[todoCnt++] = i;
+	while (todoCnt > 0) {
+		int targets[2], targetCnt = 0;
+		uint16_t cv = cmds[i = todo[--todoCnt]].cv;
+		if (fallsThrough(cv))
+			targets[targetCnt++] = i + 1;
+		if (cmds[i].referencedLabel || (isBranch(cv) && cvIsImm(cv)))
+			targets[targetCnt++] = cvImm(cv) & stepMask;
+		while (targetCnt-- > 0) {
+			int t = targets[targetCnt];
+			if (t < n && !keep[t])
+				keep[t] = true, todo[todoCnt++] = t;
+		}
+	}
+	// falling off the end of a full group wraps to step 0
+	if (n == size && keep[n - 1] && fallsThrough(cmds[n - 1].cv))
+		return 0;
+
+	do {
+		changed = false;
+		for (i = 0; i < n; i++) {
+			struct cmd *next = &cmds[i + 1], folded;
+			if (!keep[i])
+				continue;
+			if (isDeadWrite(ctx, cmds, keep, n, i)) {
+				keep[i] = false, changed = true;
+				continue;
+			}
+			// X =# v followed by Y = X becomes Y =# v if X is then dead
+			if (i + 1 >= n || !keep[i + 1] || !cvIsImm(cmds[i].cv) ||
+				cvIsImm(next->cv) || cvTst(next->cv) == CMD_TST ||
+				cvDst(next->cv) == MCC_PORT ||
+				cvSSpec(next->cv) != cvDSpec(cmds[i].cv))
+				continue;
+			folded = *next;
+			next->cv = makeImmCv(cvDOpt(next->cv), cvDst(next->cv),
+								 cvImm(cmds[i].cv));
+			next->assignType = cmds[i].assignType;
+			next->srcName = cmds[i].srcName;
+			next->referencedLabel = cmds[i].referencedLabel;
+			memset(next->sOpt, 0, sizeof(next->sOpt));
+			if (isDeadWrite(ctx, cmds, keep, n, i))
+				keep[i] = false, changed = true;
+			else
+				*next = folded;
+		}
+	} while (changed);
+
+	// if the first half is closed up, its last step must not fall through
+	if (n > half) {
+		for (last = half - 1; last > 0 && !keep[last]; last--)
+			;
+		if (fallsThrough(cmds[last].cv))
+			for (i = 0; i < half; i++)
+				keep[i] = true;
+	}
+	// close up the steps kept, retargeting references to steps removed
+	for (i = 0, kept = 0; i < size; i++) {
+		if (i == half)
+			kept = half;
+		map[i] = kept; // the new step of i if it is kept
+		kept += i >= n || keep[i];
+	}
+	/* a step removed goes on to the next step kept, in either half, or past
+	 * the last step, which wraps to step 0 in a full group
+	 */
+	for (i = n - 1, next = n < size ? map[n] : 0; i >= 0; i--)
+		if (keep[i])
+			next = map[i];
+		else
+			map[i] = next;
+	memset(closed, 0, size * sizeof(struct cmd));
+	for (i = 0, kept = 0; i < n; i++) {
+		uint16_t cv = cmds[i].cv;
+		if (!keep[i])
+			continue;
+		kept++;
+		closed[map[i]] = cmds[i];
+		if (cmds[i].referencedLabel || (isBranch(cv) && cvIsImm(cv)))
+			closed[map[i]].cv =
+				labelCv(cv, (cvImm(cv) & ~stepMask) | map[cvImm(cv) & stepMask]);
+	}
+	memcpy(cmds, closed, size * sizeof(struct cmd));
+	return n - kept;
+}
+
+static void parseGrp(struct mcasm_ctx *ctx) {
+	int maxCmdId = SET_BITS(ctx->geo.cmdBits);
+	struct cmd cmds[MAX_CMDS_PER_GRP];
+	int i = 0;
+	int cmdId;
+	const char *grpName;
+	int errors = ctx->errorCnt, saved = 0;
+	uint64_t key = 0;
+	struct grp *g;
+	if (ctx->grpCache.path) {
+		// remember where the group starts, to parse it on a cache miss
+		const char *cur = ctx->src.cur, *pushed = ctx->pushedWord;
+		int l = ctx->line, c = ctx->col;
+		long tokens = ctx->tokenCnt;
+		struct cacheEntry *e;
+		ctx->isKeyScan = true, ctx->keyScanErrs = 0;
+		grpName = peekWord();
+		key = groupKey(ctx);
+		ctx->isKeyScan = false;
+		if (key && !ctx->keyScanErrs && !ctx->trace && !ctx->listFile &&
+			!ctx->mapFile && (e = findCached(ctx, key)) != NULL) {
+			expectLineEnd(ctx);
+			g = addGroup(ctx, grpAddr(ctx, deriveSymbolValue(ctx, grpName)));
+			memcpy(g->cv, e->cv, ctx->cmdsPerGrp * sizeof(uint16_t));
+			g->saved = e->saved;
+			g->key = key;
+			g->isCached = true;
+			return;
+		}
+		// the group is lexed again, with its diagnostics, and counted once
+		ctx->src.cur = cur, ctx->pushedWord = pushed;
+		ctx->line = l, ctx->col = c;
+		ctx->tokenCnt = tokens;
+	}
+	grpName = readWord();
+	memset(cmds, 0, ctx->cmdsPerGrp * sizeof(struct cmd));
+	if (tokenIsLineTerm(grpName)) {
+		print(ctx, ERROR, "Expected a cmdGrp id\n");
+		return;
+	}
+	cmdId = deriveSymbolValue(ctx, grpName);
+	if (cmdId > maxCmdId || cmdId < 0) {
+		print(ctx, ERROR, "Command Id, %d, is out of range 0..%d\n", cmdId,
+			  maxCmdId);
+		cmdId = 0;
+	} else if (ctx->lsp)
+		lspMark(ctx, LSP_GROUP, grpName, MC_ADDR(cmdId));
+	if (readWord() != KW(CMD_GROUP_START)) {
+		print(ctx, ERROR, "expected { to start a command group\n");
+	}
+	expectLineEnd(ctx);
+	print(ctx, TRACE, "cmdGrp: %s %d:%d:%d[0x%x]\n", grpName, ctx->cmdSet,
+		  ctx->page, cmdId, grpAddr(ctx, cmdId));
+	for (i = 0; i < ctx->cmdsPerGrp && peekWord() != KW(CMD_GROUP_END); i++) {
+		while (skipWordIf(ctx, KW(NL)))
+			;
+		parseCmd(ctx, &cmds[i]);
+	}
+	if (!skipWordIf(ctx, KW(CMD_GROUP_END)))
+		print(ctx, ERROR, "expected command group to terminate with }\n");
+	enterPhase(ctx, PH_LABELS);
+	for (i = 0; i < ctx->cmdsPerGrp; i++) {
+		int l = 0;
+		if (cmds[i].referencedLabel == NULL)
+			continue;
+		for (; l < ctx->cmdsPerGrp && cmds[l].label != cmds[i].referencedLabel;
+			 l++)
+			;
+		if (l >= ctx->cmdsPerGrp)
+			print(ctx, ERROR, "referenced label, %s, not found\n",
+				  cmds[i].referencedLabel);
+		else
+			cmds[i].cv = labelCv(cmds[i].cv, l);
+	}
+	enterPhase(ctx, PH_PARSE);
+	expectLineEnd(ctx);
+	for (i = 0; i < ctx->cmdsPerGrp && ctx->lsp; i++)
+		if (cmds[i].isUsed)
+			lspCmd(ctx, cmds[i].line, cmds[i].cv, MC_ADDR(cmdId) + i);
+	if (ctx->optimize && ctx->errorCnt == errors &&
+		(saved = optimizeGroup(ctx, cmds)) > 0)
+		print(ctx, TRACE, "optimized %s: %d steps saved\n", grpName, saved);
+	for (i = 0; i < ctx->cmdsPerGrp; i++)
+		printCmd(ctx, &cmds[i]);
+	if (ctx->listFile)
+		listGroup(ctx, grpName, MC_ADDR(cmdId), cmds, saved);
+	if (ctx->mapFile)
+		mapGroup(ctx, grpName, MC_ADDR(cmdId), cmds);
+	g = addGroup(ctx, MC_ADDR(cmdId));
+	for (i = 0; i < ctx->cmdsPerGrp; i++)
+		g->cv[i] = cmds[i].cv;
+	g->saved = saved;
+	g->key = ctx->errorCnt == errors ? key : 0;
+}
+
+/* reg declares ports that are plain registers: a write only stores the value
+ * and a read returns the last value written, with no side effects. The
+ * optimizer only removes or folds accesses to registers.
+ */
+static void parseReg(struct mcasm_ctx *ctx) {
+	for (const char *word = readWord(); !tokenIsLineTerm(word);
+		 word = readWord()) {
+		int spec = derivePortValue(ctx, word);
+		if (spec < 0 || spec > SET_BITS(7)) {
+			print(ctx, ERROR, "Invalid register port %s\n", word);
+			continue;
+		}
+		print(ctx, TRACE, "register: %s = %d\n", word, spec);
+		ctx->isReg[spec] = true;
+		if (ctx->specLog) {
+			putInt(ctx->specLog, SPEC_REG);
+			putInt(ctx->specLog, spec);
+		}
+	}
+}
+
+// Returns room for len more bytes, and a NUL, at the end of the tests
+static char *growTests(struct mcasm_ctx *ctx, size_t len) {
+	if (ctx->testLen + len + 1 > ctx->testCap) {
+		ctx->testCap = (ctx->testLen + len + 1) * 2;
+		if ((ctx->tests = realloc(ctx->tests, ctx->testCap)) == NULL)
+			print(ctx, FATAL, "Out of memory adding a test\n");
+	}
+	ctx->testLen += len;
+	return ctx->tests + ctx->testLen - len;
+}
+// Append to the tests of the output file
+static void putTest(struct mcasm_ctx *ctx, const char *fmt, ...) {
+	va_list args;
+	char *p;
+	va_start(args, fmt);
+	p = growTests(ctx, vsnprintf(NULL, 0, fmt, args));
+	va_end(args);
+	va_start(args, fmt);
+	vsprintf(p, fmt, args);
+	va_end(args);
+}
+
+/* test name cmdId { ... } is a test of the group, written to the tests file of
+ * the output file as a line for mcsim -T to run. Each line of the test sets a
+ * register, reg = value, or expects a value of one once the group has run,
+ * expect reg = value, the registers set first. mcsim knows the registers.
+ */
+static void parseTest(struct mcasm_ctx *ctx) {
+	const char *name = readWord(), *grpName, *reg;
+	int maxCmdId = SET_BITS(ctx->geo.cmdBits);
+	int line = ctx->line, cmdId, value;
+	size_t start = ctx->testLen;
+	bool expecting = false;
+	if (tokenIsLineTerm(name) || tokenIsLineTerm(grpName = readWord())) {
+		print(ctx, ERROR, "Expected a test name and a cmdGrp id\n");
+		return;
+	}
+	cmdId = deriveSymbolValue(ctx, grpName);
+	if (cmdId > maxCmdId || cmdId < 0) {
+		print(ctx, ERROR, "Command Id, %d, is out of range 0..%d\n", cmdId,
+			  maxCmdId);
+		cmdId = 0;
+	}
+	if (readWord() != KW(CMD_GROUP_START))
+		print(ctx, ERROR, "expected { to start a test\n");
+	expectLineEnd(ctx);
+	putTest(ctx, "%s 0x%x %s:%d", name, grpAddr(ctx, cmdId), ctx->fileName,
+			line);
+	while (peekWord() != KW(CMD_GROUP_END) && peekWord() != KW(EOF)) {
+		if (skipWordIf(ctx, KW(NL)))
+			continue;
+		if (skipWordIf(ctx, KW(EXPECT))) {
+			if (!expecting)
+				putTest(ctx, " expect");
+			expecting = true;
+		} else if (expecting)
+			print(ctx, ERROR, "Registers are set before the expectations\n");
+		reg = readWord();
+		if (tokenIsLineTerm(reg) || readWord() != KW(EQ)) {
+			print(ctx, ERROR, "Expected reg = value in test %s\n", name);
+			continue;
+		}
+		value = deriveSymbolValue(ctx, readWord());
+		putTest(ctx, " %s=%d", reg, value);
+		expectLineEnd(ctx);
+	}
+	if (!skipWordIf(ctx, KW(CMD_GROUP_END)))
+		print(ctx, ERROR, "expected a test to terminate with }\n");
+	expectLineEnd(ctx);
+	putTest(ctx, "\n");
+	if (ctx->specLog) {
+		putInt(ctx->specLog, SPEC_TEST);
+		putInt(ctx->specLog, ctx->testLen - start);
+		fwrite(ctx->tests + start, 1, ctx->testLen - start, ctx->specLog);
+	}
+}
+
+static void parseZet(struct mcasm_ctx *ctx) {
+	parseSet(ctx, true);
+}
+static void parseSetStmt(struct mcasm_ctx *ctx) {
+	parseSet(ctx, false);
+}
+// The parser of each statement, by its keyword
+static void (*const stmtParsers[KEYWORD_CNT])(struct mcasm_ctx *) = {
+	[K_GRP] = parseGrp,		  [K_DEF] = parseDef,	  [K_ZET] = parseZet,
+	[K_SET] = parseSetStmt,	  [K_PORT] = parsePort,	  [K_REG] = parseReg,
+	[K_FORGET] = parseForget, [K_CMDSET] = parseCmdSet, [K_PAGE] = parsePage,
+	[K_EXPORT] = parseExport, [K_TEST] = parseTest,
+};
+
+static void parseStmt(struct mcasm_ctx *ctx, const char *keyWord) {
+	int k = keywordOf(keyWord);
+	if (k >= 0 && stmtParsers[k])
+		stmtParsers[k](ctx);
+	else if (keyWord != KW(NL))
+		print(ctx, ERROR, "unexpected statement keyword: %s\n", keyWord);
+}
+
+// Map, or failing that read, the whole of srcFile into src
+static bool openSource(struct mcasm_ctx *ctx, const char *srcFile) {
+	struct stat st;
+	int fd = open(srcFile, O_RDONLY);
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	ssize_t n;
+	if (fd < 0)
+		return false;
+	ctx->src.mapLen = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map =
+			mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			ctx->src.buf = map;
+			ctx->src.mapLen = st.st_size;
+			len = st.st_size;
+		}
+	}
+	while (ctx->src.mapLen == 0) {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 64 * 1024;
+			buf = realloc(buf, cap);
+			if (buf == NULL)
+				print(ctx, FATAL, "Out of memory reading %s\n", srcFile);
+		}
+		n = read(fd, buf + len, cap - len);
+		if (n < 0) {
+			free(buf);
+			close(fd);
+			return false;
+		}
+		if (n == 0) {
+			ctx->src.buf = buf;
+			break;
+		}
+		len += n;
+	}
+	close(fd);
+	ctx->src.cur = ctx->src.buf;
+	ctx->src.end = ctx->src.buf + len;
+	return true;
+}
+
+static void closeSource(struct mcasm_ctx *ctx) {
+	if (ctx->src.mapLen)
+		munmap((void *)ctx->src.buf, ctx->src.mapLen);
+	else if (!ctx->src.isBorrowed)
+		free((void *)ctx->src.buf);
+	ctx->src.buf = ctx->src.cur = ctx->src.end = NULL;
+	ctx->src.mapLen = 0;
+	ctx->src.isBorrowed = false;
+}
+
+static void parseFile(struct mcasm_ctx *ctx, const struct input *in) {
+	ctx->fileName = in->name;
+	ctx->line = 1;
+	ctx->col = 1;
+	if (in->text) {
+		ctx->src.buf = ctx->src.cur = in->text;
+		ctx->src.end = in->text + in->len;
+		ctx->src.isBorrowed = true;
+	} else if (!openSource(ctx, in->name)) {
+		// an error, not fatal, as --watch can see an input being replaced
+		print(ctx, ERROR, "Can't read %s\n", in->name);
+		return;
+	}
+	ctx->parsing = true;
+	for (const char *keyWord = readWord(); keyWord != KW(EOF);
+		 keyWord = readWord())
+		parseStmt(ctx, keyWord);
+	ctx->parsing = false;
+	closeSource(ctx);
+}
+
+/*
+ *  Opens a temporary file to write name to, returning NULL if it can't. It is
+ *  renamed over name by commitFile, so a failed write never leaves a partial
+ *  file behind.
+ */
+static FILE *createFile(struct mcasm_ctx *ctx, const char *name,
+						char **tmpName) {
+	FILE *f = NULL;
+	int fd;
+	*tmpName = malloc(strlen(name) + 64);
+	// a name of the context's own, created with the umask applied
+	do
+		sprintf(*tmpName, "%s.%ld.%p.%d", name, (long)getpid(), (void *)ctx,
+				ctx->tmpCnt++);
+	while ((fd = open(*tmpName, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0 &&
+		   errno == EEXIST);
+	if (fd < 0 || (f = fdopen(fd, "wb")) == NULL) {
+		print(ctx, ERROR, "Can't write to %s\n", name);
+		if (fd >= 0) {
+			close(fd);
+			unlink(*tmpName);
+		}
+		free(*tmpName);
+	}
+	return f;
+}
+
+// Close f, written by createFile, and rename it over name
+static bool commitFile(struct mcasm_ctx *ctx, const char *name, FILE *f,
+					   char *tmpName) {
+	bool ok = !ferror(f);
+	ctx->prof.bytesWritten += ftell(f);
+	ok = fclose(f) == 0 && ok && rename(tmpName, name) == 0;
+	if (!ok) {
+		print(ctx, ERROR, "Couldn't write the output file %s\n", name);
+		unlink(tmpName);
+	}
+	free(tmpName);
+	return ok;
+}
+
+// Writes len bytes of data to name
+static bool writeFile(struct mcasm_ctx *ctx, const char *name, const void *data,
+					  size_t len) {
+	char *tmpName;
+	FILE *f = createFile(ctx, name, &tmpName);
+	if (f == NULL)
+		return false;
+	fwrite(data, 1, len, f);
+	return commitFile(ctx, name, f, tmpName);
+}
+
+/* A snapshot holds the symbols and ports after an input that only defines
+ * them, so a later run can load them instead of parsing the input. It is only
+ * used by the same build of mcasm, if the input has not changed and the state
+ * before it is the same. The symbols below a table's low mark are the same as
+ * before the input, so only those above it are kept: a header is followed by
+ * them, then the ports, oldest first, each as an int value, int length and the
+ * characters.
+ */
+#define SNAPSHOT_MAGIC 0x4d435353 // "MCSS"
+struct snapshotHeader {
+	int magic;
+	uint64_t stamp;
+	uint64_t entry; // stateHash() before the input
+	int64_t dev, ino, size, mtimeSec, mtimeNsec;
+	int cmdSet, page, export;
+	int symbolCnt, portCnt;
+	int symbolLow, portLow; // the first kept
+	bool isReg[REG_SPECS];
+};
+
+/* Hash of the state an input starts from. The hash of a table's top symbol
+ * covers every symbol below it, by content, so it is the same in a later run.
+ */
+static uint64_t stateHash(struct mcasm_ctx *ctx) {
+	Symbol sym = topSymbol(&ctx->symbols), port = topSymbol(&ctx->ports);
+	uint64_t v[5] = {sym ? sym->hash : 0, port ? port->hash : 0, ctx->cmdSet,
+					 ctx->page, ctx->export};
+	uint64_t h = hash64(configStamp(ctx), v, sizeof(v));
+	return hash64(h, ctx->isReg, sizeof(ctx->isReg));
+}
+
+// The snapshot file of an input
+static char *snapshotName(struct mcasm_ctx *ctx, const char *input) {
+	char *name = malloc(strlen(ctx->snapshotDir) + 32);
+	sprintf(name, "%s/%016" PRIx64 ".snap", ctx->snapshotDir,
+			hash64(0xcbf29ce484222325ull, input, strlen(input)));
+	return name;
+}
+
+static bool sourceMatches(const struct snapshotHeader *h, const char *input) {
+	struct stat st;
+	return stat(input, &st) == 0 && h->dev == (int64_t)st.st_dev &&
+		   h->ino == (int64_t)st.st_ino && h->size == (int64_t)st.st_size &&
+		   h->mtimeSec == (int64_t)st.st_mtim.tv_sec &&
+		   h->mtimeNsec == (int64_t)st.st_mtim.tv_nsec;
+}
+
+static void writeTable(FILE *f, struct symTable *t) {
+	for (int i = t->low; i < t->count; i++) {
+		putInt(f, symbolAt(t, i)->value);
+		putStr(f, symbolAt(t, i)->id);
+	}
+}
+
+// Save the symbols and ports after input, which started from state entry
+static void saveSnapshot(struct mcasm_ctx *ctx, const char *input,
+						 uint64_t entry) {
+	struct snapshotHeader h;
+	struct stat st;
+	char *text, *name;
+	size_t len;
+	FILE *f;
+	if (stat(input, &st) != 0 || (f = open_memstream(&text, &len)) == NULL)
+		return;
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAPSHOT_MAGIC;
+	h.stamp = buildStamp();
+	h.entry = entry;
+	h.dev = st.st_dev, h.ino = st.st_ino, h.size = st.st_size;
+	h.mtimeSec = st.st_mtim.tv_sec, h.mtimeNsec = st.st_mtim.tv_nsec;
+	h.cmdSet = ctx->cmdSet, h.page = ctx->page, h.export = ctx->export;
+	h.symbolCnt = ctx->symbols.count, h.portCnt = ctx->ports.count;
+	h.symbolLow = ctx->symbols.low, h.portLow = ctx->ports.low;
+	memcpy(h.isReg, ctx->isReg, sizeof(ctx->isReg));
+	fwrite(&h, sizeof(h), 1, f);
+	writeTable(f, &ctx->symbols);
+	writeTable(f, &ctx->ports);
+	fclose(f);
+	name = snapshotName(ctx, input);
+	writeFile(ctx, name, text, len);
+	free(name);
+	free(text);
+}
+
+// Check that cnt symbols follow p, returning the end of the last one or NULL
+static const char *checkTable(const char *p, const char *end, int cnt) {
+	for (int i = 0; i < cnt && p; i++) {
+		int v[2]; // value, length
+		if ((size_t)(end - p) < sizeof(v))
+			return NULL;
+		memcpy(v, p, sizeof(v));
+		p += sizeof(v);
+		p = v[1] >= 0 && end - p >= v[1] ? p + v[1] : NULL;
+	}
+	return p;
+}
+
+// Replace the symbols of t from low on with those at p, to make cnt, returning
+// their end
+static const char *readTable(struct mcasm_ctx *ctx, struct symTable *t,
+							 const char *p, int low, int cnt) {
+	releaseSymbols(t, low);
+	for (int i = low; i < cnt; i++) {
+		int v[2];
+		memcpy(v, p, sizeof(v));
+		p += sizeof(v);
+		pushSymbol(ctx, t, intern(ctx, p, v[1]), v[0]);
+		p += v[1];
+	}
+	return p;
+}
+
+// Load the state after input from its snapshot, returning false if there is
+// no snapshot that can be used
+static bool loadSnapshot(struct mcasm_ctx *ctx, const char *input) {
+	char *name = snapshotName(ctx, input);
+	int fd = open(name, O_RDONLY);
+	struct snapshotHeader h;
+	struct stat st;
+	const char *map, *end, *p;
+	bool ok = false;
+	free(name);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(h) ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+			MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+	end = map + st.st_size;
+	memcpy(&h, map, sizeof(h));
+	p = map + sizeof(h);
+	if (h.magic == SNAPSHOT_MAGIC && h.stamp == buildStamp() &&
+		sourceMatches(&h, input) && h.entry == stateHash(ctx) &&
+		h.symbolLow >= 0 && h.symbolLow <= ctx->symbols.count &&
+		h.symbolLow <= h.symbolCnt && h.portLow >= 0 &&
+		h.portLow <= ctx->ports.count && h.portLow <= h.portCnt &&
+		checkTable(checkTable(p, end, h.symbolCnt - h.symbolLow), end,
+				   h.portCnt - h.portLow) == end) {
+		p = readTable(ctx, &ctx->symbols, p, h.symbolLow, h.symbolCnt);
+		readTable(ctx, &ctx->ports, p, h.portLow, h.portCnt);
+		ctx->cmdSet = h.cmdSet, ctx->page = h.page, ctx->export = h.export;
+		memcpy(ctx->isReg, h.isReg, sizeof(ctx->isReg));
+		ok = true;
+	}
+	munmap((void *)map, st.st_size);
+	return ok;
+}
+
+static void assembleInput(struct mcasm_ctx *ctx, const struct input *in) {
+	uint64_t entry = 0;
+	int errors = ctx->errorCnt;
+	size_t tests = ctx->testLen;
+	bool useSnapshot = ctx->snapshotDir && !in->trace && in->text == NULL;
+	ctx->trace = in->trace;
+	if (useSnapshot) {
+		if (loadSnapshot(ctx, in->name))
+			return;
+		entry = stateHash(ctx);
+		ctx->symbols.low = ctx->symbols.count;
+		ctx->ports.low = ctx->ports.count;
+	}
+	parseFile(ctx, in);
+	// tests, like groups, aren't kept in snapshots
+	if (useSnapshot && ctx->grpCnt == 0 && ctx->errorCnt == errors &&
+		ctx->testLen == tests)
+		saveSnapshot(ctx, in->name, entry);
+	commitGroups(ctx, in->name);
+}
+
+/* A forked worker parsing an input speculatively. Its log and diagnostics go
+ * to temporary files that the parent reads once it has finished.
+ */
+struct worker {
+	pid_t pid;
+	FILE *log;
+	FILE *err;
+	FILE *lst; // the listing of the input, if listing
+	FILE *map; // the source map of the input, if mapping
+};
+
+static void startWorker(struct mcasm_ctx *ctx, struct worker *w,
+						const struct input *in) {
+	fflush(ctx->diag);
+	if (ctx->listFile)
+		fflush(ctx->listFile);
+	if (ctx->mapFile)
+		fflush(ctx->mapFile);
+	w->log = tmpfile();
+	w->err = tmpfile();
+	w->lst = ctx->listFile ? tmpfile() : NULL;
+	w->map = ctx->mapFile ? tmpfile() : NULL;
+	if (w->log == NULL || w->err == NULL || (ctx->listFile && w->lst == NULL) ||
+		(ctx->mapFile && w->map == NULL))
+		print(ctx, FATAL, "Can't create temporary files for %s\n", in->name);
+	w->pid = fork();
+	if (w->pid < 0)
+		print(ctx, FATAL, "Can't fork a worker for %s\n", in->name);
+	if (w->pid > 0)
+		return;
+	ctx->diag = w->err;
+	if (ctx->listFile)
+		ctx->listFile = w->lst;
+	if (ctx->mapFile)
+		ctx->mapFile = w->map;
+	ctx->specLog = w->log;
+	ctx->generation++;
+	ctx->cmdSetAssigned = ctx->pageAssigned = ctx->exportAssigned = false;
+	ctx->exitStatus = EXIT_SUCCESS;
+	ctx->tokenCnt = 0;
+	memset(&ctx->prof, 0, sizeof(ctx->prof));
+	ctx->trace = in->trace;
+	putInt(ctx->specLog, SPEC_REGS);
+	fwrite(ctx->isReg, sizeof(ctx->isReg), 1, ctx->specLog);
+	parseFile(ctx, in);
+	for (int i = 0; i < ctx->grpCnt; i++) {
+		putInt(ctx->specLog, SPEC_GROUP);
+		putInt(ctx->specLog, ctx->grps[i].addr);
+		fwrite(ctx->grps[i].cv, sizeof(uint16_t), ctx->cmdsPerGrp,
+			   ctx->specLog);
+		fwrite(&ctx->grps[i].key, sizeof(ctx->grps[i].key), 1, ctx->specLog);
+		putInt(ctx->specLog, ctx->grps[i].isCached);
+		putInt(ctx->specLog, ctx->grps[i].saved);
+	}
+	putInt(ctx->specLog, SPEC_END);
+	putInt(ctx->specLog, ctx->exitStatus);
+	putInt(ctx->specLog, ctx->cmdSetAssigned ? ctx->cmdSet : -1);
+	putInt(ctx->specLog, ctx->pageAssigned ? ctx->page : -1);
+	putInt(ctx->specLog, ctx->exportAssigned ? ctx->export : -1);
+	putInt(ctx->specLog, ctx->tokenCnt);
+	if (ctx->listFile)
+		fflush(ctx->listFile);
+	if (ctx->mapFile)
+		fflush(ctx->mapFile);
+	enterPhase(ctx, PH_PARSE);
+	fwrite(&ctx->prof, sizeof(ctx->prof), 1, ctx->specLog);
+	fclose(ctx->specLog);
+	fflush(ctx->diag);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Replays a worker's log against the real state, leaving its groups pending.
+ * Returns false, with the state as it was, if the worker saw a different
+ * state or did not finish.
+ */
+static bool replayLog(struct mcasm_ctx *ctx, FILE *log) {
+	struct symTable *tables[] = {&ctx->symbols, &ctx->ports};
+	// to undo the replay, i >= 0 for a symbol pushed on tables[i] or -n - 1
+	// for n symbols forgotten, whose copies are the last n of forgotten
+	int *undo = NULL, undoCnt = 0, forgottenCnt = 0;
+	struct symbols *forgotten = NULL;
+	int op, tbl, found, value, cnt, n, v[5];
+	size_t tests = ctx->testLen;
+	struct profile p;
+	bool regs[sizeof(ctx->isReg)], savedRegs[sizeof(ctx->isReg)];
+	const char *id;
+	Symbol sym;
+	rewind(log);
+	memcpy(savedRegs, ctx->isReg, sizeof(ctx->isReg));
+	while (getInt(log, &op)) {
+		switch (op) {
+		case SPEC_REGS:
+			if (fread(regs, sizeof(regs), 1, log) != 1 ||
+				memcmp(regs, ctx->isReg, sizeof(regs)) != 0)
+				goto fail;
+			break;
+		case SPEC_REG:
+			if (!getInt(log, &value) || value < 0 || value > SET_BITS(7))
+				goto fail;
+			ctx->isReg[value] = true;
+			break;
+		case SPEC_FIND:
+			if (!getInt(log, &tbl) || !(id = getStr(ctx, log)) ||
+				!getInt(log, &found) || !getInt(log, &value))
+				goto fail;
+			sym = findSymbol(ctx, tables[tbl & 1], id);
+			if ((sym != NULL) != found || (sym && sym->value != value))
+				goto fail;
+			break;
+		case SPEC_PUSH:
+			if (!getInt(log, &tbl) || !(id = getStr(ctx, log)) ||
+				!getInt(log, &value))
+				goto fail;
+			pushSymbol(ctx, tables[tbl & 1], id, value);
+			undo = realloc(undo, (undoCnt + 1) * sizeof(int));
+			undo[undoCnt++] = tbl & 1;
+			break;
+		case SPEC_FORGET:
+			if (!getInt(log, &found) || !(id = getStr(ctx, log)) ||
+				!getInt(log, &cnt) || !getInt(log, &value))
+				goto fail;
+			n = forgetSymbols(ctx, found ? id : NULL);
+			// copy them before they are overwritten by later definitions
+			forgotten = realloc(
+				forgotten, (forgottenCnt + n) * sizeof(struct symbols) + 1);
+			for (int i = 0; i < n; i++)
+				forgotten[forgottenCnt++] =
+					*symbolAt(&ctx->symbols, ctx->symbols.count + i);
+			undo = realloc(undo, (undoCnt + 1) * sizeof(int));
+			undo[undoCnt++] = -n - 1;
+			if ((cnt >= 0 && n != cnt) || (ctx->symbols.count != 0) != value)
+				goto fail;
+			break;
+		case SPEC_HEAD:
+			if (!getInt(log, &found) || !getInt(log, &value))
+				goto fail;
+			sym = topSymbol(&ctx->symbols);
+			if ((sym != NULL) != found || (found && sym->value + 1 != value))
+				goto fail;
+			break;
+		case SPEC_CMDSET:
+		case SPEC_PAGE:
+			if (!getInt(log, &value) ||
+				value != (op == SPEC_CMDSET ? ctx->cmdSet : ctx->page))
+				goto fail;
+			break;
+		case SPEC_GROUP: {
+			struct grp *g;
+			if (!getInt(log, &value))
+				goto fail;
+			g = addGroup(ctx, value);
+			if (fread(g->cv, sizeof(uint16_t), ctx->cmdsPerGrp, log) !=
+					(size_t)ctx->cmdsPerGrp ||
+				fread(&g->key, sizeof(g->key), 1, log) != 1 ||
+				!getInt(log, &found) || !getInt(log, &g->saved))
+				goto fail;
+			g->isCached = found;
+			break;
+		}
+		case SPEC_TEST:
+			if (!getInt(log, &value) || value <= 0)
+				goto fail;
+			if (fread(growTests(ctx, value), 1, value, log) != (size_t)value)
+				goto fail;
+			break;
+		case SPEC_END:
+			for (int i = 0; i < 5; i++)
+				if (!getInt(log, &v[i]))
+					goto fail;
+			if (fread(&p, sizeof(p), 1, log) != 1)
+				goto fail;
+			if (v[0] != EXIT_SUCCESS)
+				ctx->exitStatus = v[0];
+			ctx->cmdSet = v[1] >= 0 ? v[1] : ctx->cmdSet;
+			ctx->page = v[2] >= 0 ? v[2] : ctx->page;
+			ctx->export = v[3] >= 0 ? v[3] : ctx->export;
+			ctx->tokenCnt += v[4];
+			for (int i = 0; i < PHASE_CNT; i++)
+				ctx->prof.secs[i] += p.secs[i];
+			ctx->prof.internProbes += p.internProbes;
+			ctx->prof.lookups += p.lookups;
+			free(forgotten);
+			free(undo);
+			return true;
+		default:
+			goto fail;
+		}
+	}
+fail:
+	while (undoCnt--) {
+		if (undo[undoCnt] >= 0) {
+			releaseSymbols(tables[undo[undoCnt]],
+						   tables[undo[undoCnt]]->count - 1);
+			continue;
+		}
+		n = -undo[undoCnt] - 1;
+		forgottenCnt -= n;
+		for (int i = forgottenCnt; i < forgottenCnt + n; i++)
+			pushSymbol(ctx, &ctx->symbols, forgotten[i].id, forgotten[i].value);
+	}
+	free(forgotten);
+	free(undo);
+	memcpy(ctx->isReg, savedRegs, sizeof(ctx->isReg));
+	ctx->grpCnt = 0;
+	ctx->testLen = tests;
+	return false;
+}
+
+// Copy the whole of f to the end of to
+static void copyFile(FILE *f, FILE *to) {
+	char buf[4096];
+	size_t n;
+	rewind(f);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		fwrite(buf, 1, n, to);
+}
+
+// Copy the whole of f to the diagnostics
+static void copyDiagnostics(struct mcasm_ctx *ctx, FILE *f) {
+	fflush(ctx->diag);
+	copyFile(f, ctx->diag);
+}
+
+// Parse the inputs for the current output, in parallel if jobs > 1
+static void startListing(struct mcasm_ctx *ctx) {
+	if (ctx->listFile && ctx->outputName)
+		fprintf(ctx->listFile, "; listing of %s\n", ctx->outputName);
+	if (ctx->mapFile && ctx->outputName)
+		fprintf(ctx->mapFile, "; source map of %s\n", ctx->outputName);
+}
+
+// Assemble the inputs from first on, those before it having been assembled
+static void assembleInputs(struct mcasm_ctx *ctx, int first) {
+	struct worker *workers;
+	int next; // next input to start a worker for
+	if (ctx->inputCnt == 0)
+		return;
+	if (first == 0) {
+		startListing(ctx);
+		assembleInput(ctx, &ctx->inputs[first++]);
+	}
+	if (ctx->jobs <= 1 || ctx->inputCnt - first <= 1) {
+		for (int i = first; i < ctx->inputCnt; i++)
+			assembleInput(ctx, &ctx->inputs[i]);
+		ctx->inputCnt = 0;
+		return;
+	}
+	workers = calloc(ctx->inputCnt, sizeof(struct worker));
+	next = first;
+	for (int i = first; i < ctx->inputCnt; i++) {
+		struct worker *w = &workers[i];
+		int status;
+		for (; next < ctx->inputCnt && next - i < ctx->jobs; next++)
+			startWorker(ctx, &workers[next], &ctx->inputs[next]);
+		enterPhase(ctx, PH_WAIT);
+		waitpid(w->pid, &status, 0);
+		enterPhase(ctx, PH_PARSE);
+		if (replayLog(ctx, w->log)) {
+			copyDiagnostics(ctx, w->err);
+			if (ctx->listFile)
+				copyFile(w->lst, ctx->listFile);
+			if (ctx->mapFile)
+				copyFile(w->map, ctx->mapFile);
+			commitGroups(ctx, ctx->inputs[i].name);
+		} else
+			assembleInput(ctx, &ctx->inputs[i]);
+		fclose(w->log);
+		fclose(w->err);
+		if (w->lst)
+			fclose(w->lst);
+		if (w->map)
+			fclose(w->map);
+	}
+	free(workers);
+	ctx->inputCnt = 0;
+}
+
+static void addInput(struct mcasm_ctx *ctx, const char *name, const char *text,
+					 size_t len, bool trace) {
+	struct input *in;
+	if (ctx->inputCnt == ctx->inputCap) {
+		ctx->inputCap = ctx->inputCap ? ctx->inputCap * 2 : 16;
+		ctx->inputs =
+			realloc(ctx->inputs, ctx->inputCap * sizeof(struct input));
+		if (ctx->inputs == NULL)
+			print(ctx, FATAL, "Out of memory adding input %s\n", name);
+	}
+	in = &ctx->inputs[ctx->inputCnt++];
+	in->name = name;
+	in->text = text;
+	in->len = len;
+	in->trace = trace;
+}
+
+#define STEP_EXIT -1	  // a jmp leaves the group
+#define STEP_COMPUTED -2 // branch to a step from a port
+#define STEPS_UNBOUNDED -1
+
+/* Returns the steps that can follow step of a group of size steps, with value
+ * cv, in next
+ */
+static int nextSteps(uint16_t cv, int step, int size, int *next) {
+	int cnt = 0;
+	if (fallsThrough(cv))
+		next[cnt++] = (step + 1) & (size - 1);
+	if (cvDst(cv) != MCC_PORT)
+		return cnt;
+	if (!isBranch(cv))
+		next[cnt++] = STEP_EXIT;
+	else
+		next[cnt++] = cvIsImm(cv) ? cvImm(cv) & (size - 1) : STEP_COMPUTED;
+	return cnt;
+}
+
+/* Returns the most steps that can be run from step to leaving the group, or
+ * STEPS_UNBOUNDED if a loop or a computed branch, which can go back to any
+ * step, can be reached. onPath marks the steps being visited, longest those
+ * already measured.
+ */
+static int longestRun(const uint16_t *cv, int step, int size, bool *onPath,
+					  int *longest) {
+	int next[2], cnt = nextSteps(cv[step], step, size, next), most = 0;
+	if (longest[step])
+		return longest[step];
+	if (onPath[step])
+		return STEPS_UNBOUNDED;
+	onPath[step] = true;
+	for (int i = 0; i < cnt; i++) {
+		int run = 0;
+		if (next[i] == STEP_COMPUTED)
+			run = STEPS_UNBOUNDED;
+		else if (next[i] >= 0)
+			run = longestRun(cv, next[i], size, onPath, longest);
+		if (run == STEPS_UNBOUNDED) {
+			most = STEPS_UNBOUNDED;
+			break;
+		}
+		most = run > most ? run : most;
+	}
+	onPath[step] = false;
+	return longest[step] = most == STEPS_UNBOUNDED ? most : most + 1;
+}
+
+/* Find the fewest and most steps run by the group of size steps at cv,
+ * entered at step 0, following branches, conditional branches and commands
+ * with the test bit either way. Either is STEPS_UNBOUNDED if there is no
+ * bound, and computed is set if a branch from a port, which is not followed,
+ * can be reached; most is then unbounded, and fewest ends at the branch.
+ */
+static void groupSteps(const uint16_t *cv, int size, int *fewest, int *most,
+					   bool *computed) {
+	int dist[MAX_CMDS_PER_GRP], todo[MAX_CMDS_PER_GRP], head = 0, tail = 0;
+	int longest[MAX_CMDS_PER_GRP] = {0};
+	bool onPath[MAX_CMDS_PER_GRP] = {false};
+	*fewest = STEPS_UNBOUNDED;
+	*computed = false;
+	for (int i = 0; i < size; i++)
+		dist[i] = -1;
+	dist[0] = 1, todo[tail++] = 0;
+	while (head < tail) {
+		int step = todo[head++], next[2];
+		int cnt = nextSteps(cv[step], step, size, next);
+		for (int i = 0; i < cnt; i++) {
+			if (next[i] < 0) {
+				*computed |= next[i] == STEP_COMPUTED;
+				if (*fewest == STEPS_UNBOUNDED)
+					*fewest = dist[step];
+			} else if (dist[next[i]] < 0) {
+				dist[next[i]] = dist[step] + 1;
+				todo[tail++] = next[i];
+			}
+		}
+	}
+	*most = longestRun(cv, 0, size, onPath, longest);
+}
+
+// Write the step counts of the groups assembled into the image to costFile
+static void writeCosts(struct mcasm_ctx *ctx) {
+	for (int g = 0; g < ctx->storeSize / ctx->cmdsPerGrp; g++) {
+		int fewest, most;
+		bool computed;
+		char fewStr[12] = "inf", mostStr[12] = "inf";
+		if (ctx->grpOwner[g] == NULL)
+			continue;
+		groupSteps(&ctx->image[g * ctx->cmdsPerGrp], ctx->cmdsPerGrp, &fewest,
+				   &most, &computed);
+		if (fewest != STEPS_UNBOUNDED)
+			sprintf(fewStr, "%d", fewest);
+		if (most != STEPS_UNBOUNDED)
+			sprintf(mostStr, "%d", most);
+		fprintf(ctx->costFile, "%-6d %-4d %-5d %4.4x  %5s %5s  %-8s %s\n",
+				g >> (ctx->geo.pageBits + ctx->geo.cmdBits),
+				(g >> ctx->geo.cmdBits) & SET_BITS(ctx->geo.pageBits),
+				g & SET_BITS(ctx->geo.cmdBits), g * ctx->cmdsPerGrp, fewStr,
+				mostStr,
+				computed				   ? "computed"
+				: most == STEPS_UNBOUNDED ? "loop"
+										   : "-",
+				ctx->grpOwner[g]);
+	}
+}
+
+/* Shared tails. Groups often end with the same steps, such as the fetch and
+ * dispatch of the next opcode. With --share-tails, steps that end several
+ * groups of a command set are moved, when the image is written, into a group
+ * at a cmdId no group was assembled at, and each copy is replaced by a jmp to
+ * it. Groups with a computed branch, and full groups that fall off their last
+ * step, are left alone. A tail is only moved if no branch before it reaches
+ * past its first step, none in it leaves it and it doesn't hold the half way
+ * entry after its first step. Each group sharing a tail runs one more step,
+ * the jmp, on the paths through it.
+ */
+struct tail {
+	uint64_t hash; // of its steps, with branches made relative
+	int grp;	   // in the image
+	int start, len;
+};
+
+// cv, with the target of an immediate branch made relative to its step
+static uint16_t relativeCv(const struct mcasm_ctx *ctx, uint16_t cv,
+						   int step) {
+	int stepMask = SET_BITS(ctx->geo.stepBits);
+	if (!isBranch(cv) || !cvIsImm(cv))
+		return cv;
+	return (cv & ~stepMask) | ((cvImm(cv) - step) & stepMask);
+}
+
+// Add the tails of group g that could be shared to tails, returning how many
+static int groupTails(const struct mcasm_ctx *ctx, int g, struct tail *tails) {
+	const int size = ctx->cmdsPerGrp, half = size / 2;
+	const int stepMask = SET_BITS(ctx->geo.stepBits);
+	const uint16_t *cv = &ctx->image[g * size];
+	int highest[MAX_CMDS_PER_GRP + 1]; // step branched to before each step
+	int n, cnt = 0, lowest = size;	   // step branched to from the tail
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (n = size; n > 0 && cv[n - 1] == 0; n--)
+		;
+	if (n == 0 || (n == size && fallsThrough(cv[n - 1])))
+		return 0;
+	highest[0] = 0;
+	for (int i = 0; i < n; i++) {
+		int t = isBranch(cv[i]) ? cvImm(cv[i]) & stepMask : 0;
+		if (isBranch(cv[i]) && !cvIsImm(cv[i]))
+			return 0; // a computed branch can reach any step
+		highest[i + 1] = t > highest[i] ? t : highest[i];
+	}
+	for (int k = n - 1; k >= 0; k--) {
+		uint16_t rel = relativeCv(ctx, cv[k], k);
+		if (isBranch(cv[k]) && (cvImm(cv[k]) & stepMask) < lowest)
+			lowest = cvImm(cv[k]) & stepMask;
+		h = hash64(h, &rel, sizeof(rel));
+		if (n - k < 2 || lowest < k || highest[k] > k ||
+			(k < half && n > half))
+			continue;
+		tails[cnt++] = (struct tail){h, g, k, n - k};
+	}
+	return cnt;
+}
+
+static int byTail(const void *a, const void *b) {
+	const struct tail *x = a, *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->len != y->len)
+		return x->len - y->len;
+	return x->grp - y->grp;
+}
+
+static bool sameTail(const struct mcasm_ctx *ctx, const struct tail *a,
+					 const struct tail *b) {
+	const uint16_t *x = &ctx->image[a->grp * ctx->cmdsPerGrp + a->start];
+	const uint16_t *y = &ctx->image[b->grp * ctx->cmdsPerGrp + b->start];
+	if (a->len != b->len)
+		return false;
+	for (int i = 0; i < a->len; i++)
+		if (relativeCv(ctx, x[i], a->start + i) !=
+			relativeCv(ctx, y[i], b->start + i))
+			return false;
+	return true;
+}
+
+/* Returns a group of cmdSet that no group was assembled at and that a jmp can
+ * reach, by its page bit and an immediate cmdId, or -1 if there is none
+ */
+static int freeGroup(const struct mcasm_ctx *ctx, int cmdSet) {
+	int pages = ctx->geo.pageBits > 0 ? 2 : 1;
+	int cmdIds = ctx->geo.cmdBits < 8 ? 1 << ctx->geo.cmdBits : 256;
+	for (int page = pages - 1; page >= 0; page--)
+		for (int cmdId = cmdIds - 1; cmdId >= 0; cmdId--) {
+			int g = mcAddr(ctx, cmdSet, page, cmdId) / ctx->cmdsPerGrp;
+			if (ctx->grpOwner[g] == NULL)
+				return g;
+		}
+	return -1;
+}
+
+/* Move the steps of the first of cnt tails to group to, and replace each of
+ * them that is the same with a jmp to it. Returns the tails replaced.
+ */
+static int moveTail(struct mcasm_ctx *ctx, const struct tail *tails, int cnt,
+					int to) {
+	const int size = ctx->cmdsPerGrp;
+	const struct tail shared = {0, to, 0, tails[0].len};
+	const uint16_t *from = &ctx->image[tails[0].grp * size + tails[0].start];
+	uint16_t *cv = &ctx->image[to * size];
+	int page = (to >> ctx->geo.cmdBits) & SET_BITS(ctx->geo.pageBits);
+	int cmdId = to & SET_BITS(ctx->geo.cmdBits), moved = 0;
+	uint16_t jmp = makeImmCv(page << 2, MCC_PORT, cmdId);
+	char val[32], jmpVal[32];
+	formatCmdVal(ctx, jmpVal, jmp);
+	// branches in a tail only reach its own steps
+	for (int i = 0; i < shared.len; i++)
+		cv[i] = isBranch(from[i])
+					? labelCv(from[i], cvImm(from[i]) - tails[0].start)
+					: from[i];
+	ctx->grpOwner[to] = ctx->grpOwner[tails[0].grp];
+	if (ctx->listFile) {
+		fprintf(ctx->listFile, "\n; shared tail %d:%d:%d  %s\n",
+				to >> (ctx->geo.pageBits + ctx->geo.cmdBits), page, cmdId,
+				ctx->grpOwner[to]);
+		for (int i = 0; i < shared.len; i++) {
+			formatCmdVal(ctx, val, cv[i]);
+			fprintf(ctx->listFile, "%4.4x  %4.4x  %s      -  from %4.4x\n",
+					to * size + i, cv[i], val,
+					tails[0].grp * size + tails[0].start + i);
+		}
+	}
+	if (ctx->mapFile)
+		for (int i = 0; i < shared.len; i++)
+			fprintf(ctx->mapFile, "%4.4x shared - 0 %s\n", to * size + i,
+					ctx->grpOwner[to]);
+	for (int i = 0; i < cnt; i++) {
+		int addr = tails[i].grp * size + tails[i].start;
+		if (!sameTail(ctx, &shared, &tails[i]))
+			continue;
+		memset(&ctx->image[addr], 0, tails[i].len * sizeof(uint16_t));
+		ctx->image[addr] = jmp;
+		moved++;
+		if (ctx->listFile)
+			fprintf(ctx->listFile, "%4.4x  %4.4x  %s      -  jmp to it\n",
+					addr, jmp, jmpVal);
+	}
+	return moved;
+}
+
+/* Share the tails of the groups of each command set, while there is a free
+ * group to hold one and it reclaims more steps than it takes
+ */
+static void shareTails(struct mcasm_ctx *ctx) {
+	const int size = ctx->cmdsPerGrp;
+	const int grpsPerSet = 1 << (ctx->geo.pageBits + ctx->geo.cmdBits);
+	struct tail *tails = NULL;
+	int cap = 0, shared = 0, jmps = 0;
+	long reclaimed = 0;
+	for (int cmdSet = 0; cmdSet < 1 << ctx->geo.cmdSetBits; cmdSet++) {
+		int to;
+		while ((to = freeGroup(ctx, cmdSet)) >= 0) {
+			int cnt = 0, best = -1, bestCnt = 0, most = 0;
+			for (int g = cmdSet * grpsPerSet; g < (cmdSet + 1) * grpsPerSet;
+				 g++) {
+				if (ctx->grpOwner[g] == NULL)
+					continue;
+				if (cnt + size > cap) {
+					cap = 2 * cap + size;
+					if ((tails = realloc(tails, cap * sizeof(*tails))) == NULL)
+						print(ctx, FATAL, "Out of memory sharing tails\n");
+				}
+				cnt += groupTails(ctx, g, &tails[cnt]);
+			}
+			qsort(tails, cnt, sizeof(*tails), byTail);
+			for (int i = 0, j; i < cnt; i = j) {
+				int same = 0, saving;
+				for (j = i; j < cnt && tails[j].hash == tails[i].hash &&
+							tails[j].len == tails[i].len;
+					 j++)
+					same += sameTail(ctx, &tails[i], &tails[j]);
+				// each copy becomes a jmp and the free group holds one
+				saving = same * (tails[i].len - 1) - tails[i].len;
+				if (saving > most)
+					most = saving, best = i, bestCnt = j - i;
+			}
+			if (best < 0)
+				break;
+			jmps += moveTail(ctx, &tails[best], bestCnt, to);
+			shared++, reclaimed += most;
+		}
+	}
+	free(tails);
+	ctx->stepsReclaimed += reclaimed;
+	fprintf(ctx->diag,
+			"%s: %d shared tails reclaim %ld steps (%ld bytes), adding a jmp "
+			"step to %d groups\n",
+			ctx->outputName, shared, reclaimed, 2 * reclaimed, jmps);
+}
+
+// Intel HEX record of len bytes at addr, with its checksum
+static void putHexRecord(FILE *f, int type, int addr, const unsigned char *data,
+						 int len) {
+	unsigned sum = len + (addr >> 8) + addr + type;
+	fprintf(f, ":%2.2X%4.4X%2.2X", len, addr & 0xffff, type);
+	for (int i = 0; i < len; i++) {
+		fprintf(f, "%2.2X", data[i]);
+		sum += data[i];
+	}
+	fprintf(f, "%2.2X\n", -sum & 0xff);
+}
+
+// S-record of len bytes at addr, with an address of addrLen bytes
+static void putSRecord(FILE *f, int type, int addrLen, int addr,
+					   const unsigned char *data, int len) {
+	unsigned sum = len + addrLen + 1;
+	fprintf(f, "S%d%2.2X", type, len + addrLen + 1);
+	for (int i = addrLen - 1; i >= 0; i--) {
+		fprintf(f, "%2.2X", (addr >> (8 * i)) & 0xff);
+		sum += addr >> (8 * i);
+	}
+	for (int i = 0; i < len; i++) {
+		fprintf(f, "%2.2X", data[i]);
+		sum += data[i];
+	}
+	fprintf(f, "%2.2X\n", ~sum & 0xff);
+}
+
+/* The bytes of a lane of the image are those of both, two per command with
+ * the low byte first, or the low or high byte of each command. A byte is used
+ * if its command is in a group assembled.
+ */
+static int laneLen(const struct mcasm_ctx *ctx, enum mcasm_lane lane) {
+	return lane == MCASM_BOTH ? 2 * ctx->storeSize : ctx->storeSize;
+}
+static unsigned char laneByte(const struct mcasm_ctx *ctx, enum mcasm_lane lane,
+							  int i) {
+	if (lane == MCASM_BOTH)
+		return ctx->image[i / 2] >> 8 * (i & 1);
+	return ctx->image[i] >> (lane == MCASM_HIGH ? 8 : 0);
+}
+static bool laneUsed(const struct mcasm_ctx *ctx, enum mcasm_lane lane,
+					 int i) {
+	return ctx->grpOwner[(lane == MCASM_BOTH ? i / 2 : i) / ctx->cmdsPerGrp];
+}
+
+/* Writes a lane as text in outFormat, with only the bytes used, in records of
+ * up to 16 bytes that don't cross a gap
+ */
+static void encodeHex(struct mcasm_ctx *ctx, FILE *f, enum mcasm_lane lane) {
+	bool isSRec = ctx->outFormat == MCASM_SREC;
+	int len = laneLen(ctx, lane), upper = 0;
+	int addrLen = len > 0x1000000 ? 4 : len > 0x10000 ? 3 : 2;
+	int grpLen = lane == MCASM_BOTH ? 2 * ctx->cmdsPerGrp : ctx->cmdsPerGrp;
+	unsigned char data[16];
+	if (isSRec)
+		putSRecord(f, 0, 2, 0, (const unsigned char *)"mcasm", 5);
+	for (int addr = 0; addr < len;) {
+		int cnt = 0;
+		if (!laneUsed(ctx, lane, addr)) {
+			addr += grpLen; // the rest of the group is unused too
+			continue;
+		}
+		while (cnt < 16 && addr + cnt < len && laneUsed(ctx, lane, addr + cnt) &&
+			   (cnt == 0 || (addr + cnt) % 0x10000 != 0)) {
+			data[cnt] = laneByte(ctx, lane, addr + cnt);
+			cnt++;
+		}
+		if (isSRec)
+			putSRecord(f, addrLen - 1, addrLen, addr, data, cnt);
+		else {
+			if (addr >> 16 != upper) {
+				unsigned char ext[2] = {addr >> 24, addr >> 16};
+				putHexRecord(f, 4, 0, ext, 2);
+				upper = addr >> 16;
+			}
+			putHexRecord(f, 0, addr, data, cnt);
+		}
+		addr += cnt;
+	}
+	if (isSRec)
+		putSRecord(f, 11 - addrLen, addrLen, 0, NULL, 0);
+	else
+		putHexRecord(f, 1, 0, NULL, 0);
+}
+
+/* Writes a lane to f in outFormat, the whole store in binary and only the
+ * groups assembled in HEX and S-record text
+ */
+static void encodeLane(struct mcasm_ctx *ctx, FILE *f, enum mcasm_lane lane) {
+	unsigned char chunk[4096];
+	int len = laneLen(ctx, lane), n;
+	if (ctx->outFormat != MCASM_BIN) {
+		encodeHex(ctx, f, lane);
+		return;
+	}
+	for (int addr = 0; addr < len; addr += n) {
+		n = len - addr < (int)sizeof(chunk) ? len - addr : (int)sizeof(chunk);
+		for (int i = 0; i < n; i++)
+			chunk[i] = laneByte(ctx, lane, addr + i);
+		fwrite(chunk, 1, n, f);
+	}
+}
+
+static bool writeLane(struct mcasm_ctx *ctx, const char *name,
+					  enum mcasm_lane lane) {
+	char *tmpName;
+	FILE *f = createFile(ctx, name, &tmpName);
+	if (f == NULL)
+		return false;
+	encodeLane(ctx, f, lane);
+	return commitFile(ctx, name, f, tmpName);
+}
+
+/* Read the binary image of the store at name into cv. false if it can't be
+ * read or isn't the size of the store.
+ */
+static bool readImage(struct mcasm_ctx *ctx, const char *name, uint16_t *cv) {
+	unsigned char chunk[4096];
+	FILE *f = fopen(name, "rb");
+	struct stat st;
+	int i, n = 1;
+	if (f == NULL || fstat(fileno(f), &st) != 0) {
+		print(ctx, ERROR, "Can't read the image %s\n", name);
+		if (f)
+			fclose(f);
+		return false;
+	}
+	if (st.st_size != 2L * ctx->storeSize) {
+		print(ctx, ERROR, "%s is not a binary image of %d commands\n", name,
+			  ctx->storeSize);
+		fclose(f);
+		return false;
+	}
+	for (i = 0; i < ctx->storeSize && n > 0; i += n) {
+		n = fread(chunk, 2, sizeof(chunk) / 2, f);
+		for (int j = 0; j < n && i + j < ctx->storeSize; j++)
+			cv[i + j] = chunk[2 * j] | chunk[2 * j + 1] << 8;
+	}
+	fclose(f);
+	if (i < ctx->storeSize)
+		print(ctx, ERROR, "Can't read the image %s\n", name);
+	return i >= ctx->storeSize;
+}
+
+static void putPatch(FILE *f, uint16_t *crc, const uint8_t *p, size_t len) {
+	*crc = crc16(*crc, p, len);
+	fwrite(p, 1, len, f);
+}
+
+// Write the run of len commands of the image from addr to the patch
+static void putRun(struct mcasm_ctx *ctx, FILE *f, uint16_t *crc, int addr,
+				   int len) {
+	uint8_t run[PATCH_RUN_LEN + 2 * PATCH_MAX_RUN] = {addr >> 16, addr >> 8,
+													  addr, len};
+	for (int i = 0; i < len; i++) {
+		run[PATCH_RUN_LEN + 2 * i] = ctx->image[addr + i];
+		run[PATCH_RUN_LEN + 2 * i + 1] = ctx->image[addr + i] >> 8;
+	}
+	putPatch(f, crc, run, PATCH_RUN_LEN + 2 * len);
+}
+
+/* Write a patch from the image at patchBase to the image, to name. Groups are
+ * compared whole and only those that differ step by step. Steps that differ
+ * are sent in runs, joined where the steps between them take no more bytes
+ * than starting a new run.
+ */
+static bool writePatch(struct mcasm_ctx *ctx, const char *name) {
+	uint16_t *base = malloc(ctx->storeSize * sizeof(uint16_t));
+	uint16_t crc = PATCH_CRC_START, baseCrc, newCrc;
+	int start = -1, last = -1, runs = 0, changed = 0;
+	uint8_t header[PATCH_HEADER_LEN] = PATCH_MAGIC, end[PATCH_RUN_LEN] = {0};
+	char *tmpName;
+	FILE *f;
+	long len;
+	if (base == NULL)
+		print(ctx, FATAL, "Out of memory writing the patch %s\n", name);
+	if (!readImage(ctx, ctx->patchBase, base) ||
+		(f = createFile(ctx, name, &tmpName)) == NULL) {
+		free(base);
+		return false;
+	}
+	baseCrc = crc16Commands(PATCH_CRC_START, base, ctx->storeSize);
+	newCrc = crc16Commands(PATCH_CRC_START, ctx->image, ctx->storeSize);
+	header[4] = ctx->geo.cmdSetBits + ctx->geo.pageBits + ctx->geo.cmdBits +
+				ctx->geo.stepBits;
+	header[5] = baseCrc >> 8, header[6] = baseCrc;
+	header[7] = newCrc >> 8, header[8] = newCrc;
+	putPatch(f, &crc, header, sizeof(header));
+	for (int g = 0; g < ctx->storeSize; g += ctx->cmdsPerGrp) {
+		if (memcmp(&ctx->image[g], &base[g],
+				   ctx->cmdsPerGrp * sizeof(uint16_t)) == 0)
+			continue;
+		for (int a = g; a < g + ctx->cmdsPerGrp; a++) {
+			if (ctx->image[a] == base[a])
+				continue;
+			changed++;
+			if (start >= 0 && 2 * (a - last - 1) <= PATCH_RUN_LEN &&
+				a - start < PATCH_MAX_RUN) {
+				last = a;
+				continue;
+			}
+			if (start >= 0)
+				putRun(ctx, f, &crc, start, last - start + 1), runs++;
+			start = last = a;
+		}
+	}
+	if (start >= 0)
+		putRun(ctx, f, &crc, start, last - start + 1), runs++;
+	putPatch(f, &crc, end, sizeof(end));
+	fputc(crc >> 8, f);
+	fputc(crc & 0xff, f);
+	len = ftell(f);
+	free(base);
+	if (!commitFile(ctx, name, f, tmpName))
+		return false;
+	fprintf(ctx->diag,
+			"%s: %d commands changed from %s, in %d runs of %ld bytes\n",
+			name, changed, ctx->patchBase, runs, len);
+	return true;
+}
+
+// Write the tests of the output file, after the geometry they are for
+static bool writeTests(struct mcasm_ctx *ctx, const char *name) {
+	char *tmpName;
+	FILE *f = createFile(ctx, name, &tmpName);
+	if (f == NULL)
+		return false;
+	fprintf(f, "; tests of %s\n; geometry %d:%d:%d:%d\n", ctx->outputName,
+			ctx->geo.cmdSetBits, ctx->geo.pageBits, ctx->geo.cmdBits,
+			ctx->geo.stepBits);
+	fwrite(ctx->tests, 1, ctx->testLen, f);
+	return commitFile(ctx, name, f, tmpName);
+}
+
+/*
+ *  Writes the microcode store to outputName, two bytes per command with the
+ *  low byte first, or with --lanes the low and high bytes of each command to
+ *  outputName.lo and outputName.hi. The image is encoded as it is written, so
+ *  large stores need no more memory. With --patch the changes from the base
+ *  image also go to outputName.patch, and the tests the inputs declare go to
+ *  outputName.tests.
+ */
+static bool writeOutputFile(struct mcasm_ctx *ctx) {
+	char *name = malloc(strlen(ctx->outputName) + sizeof(".patch"));
+	bool ok;
+	if (!ctx->lanes)
+		ok = writeLane(ctx, ctx->outputName, MCASM_BOTH);
+	else {
+		sprintf(name, "%s.lo", ctx->outputName);
+		ok = writeLane(ctx, name, MCASM_LOW);
+		sprintf(name, "%s.hi", ctx->outputName);
+		ok = writeLane(ctx, name, MCASM_HIGH) && ok;
+	}
+	if (ctx->patchBase) {
+		sprintf(name, "%s.patch", ctx->outputName);
+		ok = writePatch(ctx, name) && ok;
+	}
+	if (ctx->testLen) {
+		sprintf(name, "%s.tests", ctx->outputName);
+		ok = writeTests(ctx, name) && ok;
+	}
+	free(name);
+	return ok;
+}
+
+/* The state before an input is assembled, so --watch can assemble again from
+ * the first input that changed, keeping the strings interned
+ */
+struct tableCopy {
+	struct symbols *syms; // oldest first
+	int count;
+};
+struct checkpoint {
+	struct tableCopy symbols, ports;
+	int cmdSet, page, export, exitStatus;
+	bool isReg[REG_SPECS];
+	size_t testLen;
+	uint16_t *image;
+	const char **grpOwner;
+};
+
+static void copyTable(struct symTable *t, struct tableCopy *c) {
+	c->syms = realloc(c->syms, t->count * sizeof(struct symbols) + 1);
+	c->count = t->count;
+	for (int i = 0; i < t->count; i++)
+		c->syms[i] = *symbolAt(t, i);
+}
+
+static void restoreTable(struct mcasm_ctx *ctx, struct symTable *t,
+						 const struct tableCopy *c) {
+	releaseSymbols(t, 0);
+	for (int i = 0; i < c->count; i++)
+		pushSymbol(ctx, t, c->syms[i].id, c->syms[i].value);
+}
+
+static void saveCheckpoint(struct mcasm_ctx *ctx, struct checkpoint *c) {
+	copyTable(&ctx->symbols, &c->symbols);
+	copyTable(&ctx->ports, &c->ports);
+	c->cmdSet = ctx->cmdSet, c->page = ctx->page, c->export = ctx->export;
+	c->exitStatus = ctx->exitStatus;
+	memcpy(c->isReg, ctx->isReg, sizeof(ctx->isReg));
+	c->testLen = ctx->testLen;
+	if (c->image == NULL) {
+		c->image = malloc(ctx->storeSize * sizeof(uint16_t));
+		c->grpOwner =
+			malloc(ctx->storeSize / ctx->cmdsPerGrp * sizeof(const char *));
+		if (c->image == NULL || c->grpOwner == NULL)
+			print(ctx, FATAL, "Out of memory watching the inputs\n");
+	}
+	memcpy(c->image, ctx->image, ctx->storeSize * sizeof(uint16_t));
+	memcpy(c->grpOwner, ctx->grpOwner,
+		   ctx->storeSize / ctx->cmdsPerGrp * sizeof(const char *));
+}
+
+static void restoreCheckpoint(struct mcasm_ctx *ctx,
+							  const struct checkpoint *c) {
+	restoreTable(ctx, &ctx->symbols, &c->symbols);
+	restoreTable(ctx, &ctx->ports, &c->ports);
+	ctx->cmdSet = c->cmdSet, ctx->page = c->page, ctx->export = c->export;
+	ctx->exitStatus = c->exitStatus;
+	memcpy(ctx->isReg, c->isReg, sizeof(ctx->isReg));
+	ctx->testLen = c->testLen;
+	memcpy(ctx->image, c->image, ctx->storeSize * sizeof(uint16_t));
+	memcpy(ctx->grpOwner, c->grpOwner,
+		   ctx->storeSize / ctx->cmdsPerGrp * sizeof(const char *));
+}
+
+/* Assemble the inputs from first on, from the checkpoint before it, and write
+ * the image
+ */
+static void reassemble(struct mcasm_ctx *ctx, struct checkpoint *checkpoints,
+					   int first) {
+	restoreCheckpoint(ctx, &checkpoints[first]);
+	for (int i = first; i < ctx->inputCnt; i++) {
+		if (i > first)
+			saveCheckpoint(ctx, &checkpoints[i]);
+		assembleInput(ctx, &ctx->inputs[i]);
+	}
+	if (ctx->exitStatus == EXIT_SUCCESS) {
+		if (ctx->shareTails)
+			shareTails(ctx);
+		writeOutputFile(ctx);
+	} else
+		print(ctx, WARN, "%s not written due to errors\n", ctx->outputName);
+	if (ctx->grpCache.path)
+		saveGroupCache(ctx);
+}
+
+/* Assemble the inputs of the last output file, then wait for them to change
+ * and assemble them again from the first that changed. Directories are
+ * watched, not the inputs, so inputs replaced by editors are seen.
+ */
+static void watchInputs(struct mcasm_ctx *ctx) {
+	struct checkpoint *checkpoints =
+		calloc(ctx->inputCnt, sizeof(*checkpoints));
+	int *wds = malloc(ctx->inputCnt * sizeof(int));
+	int fd = inotify_init1(IN_CLOEXEC);
+	union {
+		struct inotify_event e;
+		char buf[4096];
+	} events;
+	if (checkpoints == NULL || wds == NULL)
+		print(ctx, FATAL, "Out of memory watching the inputs\n");
+	if (fd < 0)
+		print(ctx, FATAL, "Can't watch the inputs\n");
+	for (int i = 0; i < ctx->inputCnt; i++) {
+		char *dir;
+		wds[i] = -1;
+		if (ctx->inputs[i].text)
+			continue; // in memory, so it can't change
+		dir = strdup(ctx->inputs[i].name);
+		wds[i] = inotify_add_watch(fd, dirname(dir),
+								   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+		if (wds[i] < 0)
+			print(ctx, FATAL, "Can't watch %s\n", ctx->inputs[i].name);
+		free(dir);
+	}
+	saveCheckpoint(ctx, &checkpoints[0]);
+	reassemble(ctx, checkpoints, 0);
+	for (;;) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		struct timespec start, end;
+		int first = ctx->inputCnt;
+		// wait for a change, then collect those made with it
+		for (int timeout = -1; poll(&pfd, 1, timeout) > 0; timeout = 20) {
+			ssize_t len = read(fd, events.buf, sizeof(events.buf));
+			for (char *p = events.buf; len > 0 && p < events.buf + len;) {
+				struct inotify_event *e = (struct inotify_event *)p;
+				for (int i = 0; i < first && e->len; i++) {
+					char *name = strdup(ctx->inputs[i].name);
+					if (wds[i] == e->wd && strcmp(basename(name), e->name) == 0)
+						first = i;
+					free(name);
+				}
+				p += sizeof(struct inotify_event) + e->len;
+			}
+		}
+		if (first == ctx->inputCnt)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		reassemble(ctx, checkpoints, first);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(ctx->diag, "%s: assembled from %s in %.1f ms\n",
+				ctx->outputName,
+				ctx->inputs[first].name,
+				(end.tv_sec - start.tv_sec) * 1e3 +
+					(end.tv_nsec - start.tv_nsec) / 1e6);
+	}
+}
+
+/* The language server. Messages are JSON-RPC, each after a Content-Length
+ * header. Only the parts of them the server uses are parsed, in place.
+ */
+static const char *jsonSpace(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+// Returns the end of the JSON value at p, or NULL if it is malformed
+static const char *jsonSkip(const char *p) {
+	const char *start;
+	char close;
+	p = jsonSpace(p);
+	if (*p == '"') {
+		for (p++; *p && *p != '"'; p++)
+			if (*p == '\\' && p[1])
+				p++;
+		return *p ? p + 1 : NULL;
+	}
+	if (*p == '{' || *p == '[') {
+		close = *p == '{' ? '}' : ']';
+		if (*(p = jsonSpace(p + 1)) == close)
+			return p + 1;
+		for (;;) {
+			if (close == '}' && ((p = jsonSkip(p)) == NULL ||
+								 *(p = jsonSpace(p)) != ':'))
+				return NULL;
+			if ((p = jsonSkip(close == '}' ? p + 1 : p)) == NULL)
+				return NULL;
+			if (*(p = jsonSpace(p)) == close)
+				return p + 1;
+			if (*p++ != ',')
+				return NULL;
+		}
+	}
+	for (start = p; *p && strchr("+-.0123456789Eaeflnrstu", *p); p++)
+		;
+	return p > start ? p : NULL;
+}
+
+// The value of key in the object at p, or NULL
+static const char *jsonGet(const char *p, const char *key) {
+	size_t len = strlen(key);
+	if (p == NULL || *(p = jsonSpace(p)) != '{')
+		return NULL;
+	for (p = jsonSpace(p + 1); *p == '"'; p = jsonSpace(p + 1)) {
+		const char *k = p + 1, *value;
+		if ((p = jsonSkip(p)) == NULL || *(p = jsonSpace(p)) != ':')
+			return NULL;
+		value = jsonSpace(p + 1);
+		if ((size_t)(p - k) >= len + 1 && strncmp(k, key, len) == 0 &&
+			k[len] == '"' && jsonSpace(k + len + 1) == p)
+			return value;
+		if ((p = jsonSkip(value)) == NULL || *(p = jsonSpace(p)) != ',')
+			return NULL;
+	}
+	return NULL;
+}
+
+// The value at the path of keys, ended by NULL, from the object at p
+static const char *jsonPath(const char *p, ...) {
+	va_list keys;
+	va_start(keys, p);
+	for (const char *key = va_arg(keys, const char *); key && p;
+		 key = va_arg(keys, const char *))
+		p = jsonGet(p, key);
+	va_end(keys);
+	return p;
+}
+
+static long jsonInt(const char *p) {
+	return p ? strtol(p, NULL, 10) : -1;
+}
+
+// The first element of the array at p, or NULL if it is empty or not one
+static const char *jsonFirst(const char *p) {
+	if (p == NULL || *(p = jsonSpace(p)) != '[' || *jsonSpace(p + 1) == ']')
+		return NULL;
+	return jsonSpace(p + 1);
+}
+// The element after the one at p, or NULL if it is the last
+static const char *jsonNext(const char *p) {
+	if ((p = jsonSkip(p)) == NULL || *(p = jsonSpace(p)) != ',')
+		return NULL;
+	return jsonSpace(p + 1);
+}
+
+static char *putUtf8(char *s, unsigned c) {
+	if (c < 0x80)
+		*s++ = c;
+	else if (c < 0x800)
+		*s++ = 0xc0 | c >> 6, *s++ = 0x80 | (c & 0x3f);
+	else if (c < 0x10000)
+		*s++ = 0xe0 | c >> 12, *s++ = 0x80 | (c >> 6 & 0x3f),
+		*s++ = 0x80 | (c & 0x3f);
+	else
+		*s++ = 0xf0 | c >> 18, *s++ = 0x80 | (c >> 12 & 0x3f),
+		*s++ = 0x80 | (c >> 6 & 0x3f), *s++ = 0x80 | (c & 0x3f);
+	return s;
+}
+
+// The string at p unescaped into a malloced buffer, or NULL if it isn't one
+static char *jsonString(const char *p, size_t *len) {
+	const char *end;
+	char *s, *o;
+	unsigned c, low;
+	if (p == NULL || *(p = jsonSpace(p)) != '"' ||
+		(end = jsonSkip(p)) == NULL || (s = o = malloc(end - p)) == NULL)
+		return NULL;
+	for (p++; p < end - 1; p++) {
+		if (*p != '\\') {
+			*o++ = *p;
+			continue;
+		}
+		switch (*++p) {
+		case 'b': *o++ = '\b'; break;
+		case 'f': *o++ = '\f'; break;
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 'u':
+			if (sscanf(p + 1, "%4x", &c) != 1)
+				break;
+			p += 4;
+			if (c >= 0xd800 && c < 0xdc00 && p[1] == '\\' && p[2] == 'u' &&
+				sscanf(p + 3, "%4x", &low) == 1) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				p += 6;
+			}
+			o = putUtf8(o, c);
+			break;
+		default: *o++ = *p;
+		}
+	}
+	*o = '\0';
+	if (len)
+		*len = o - s;
+	return s;
+}
+
+static void jsonPutStr(FILE *f, const char *s) {
+	putc('"', f);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < ' ')
+			fprintf(f, "\\u%04x", *s);
+		else
+			putc(*s, f);
+	putc('"', f);
+}
+
+// Read a message, returning its content malloced, or NULL at the end of in
+static char *lspRead(FILE *in) {
+	char header[256], *msg;
+	long len = -1;
+	while (fgets(header, sizeof(header), in)) {
+		if (strncmp(header, "Content-Length:", 15) == 0)
+			len = atol(header + 15);
+		else if (strcmp(header, "\r\n") == 0 && len >= 0) {
+			if ((msg = malloc(len + 1)) == NULL)
+				return NULL;
+			if (fread(msg, 1, len, in) == (size_t)len) {
+				msg[len] = '\0';
+				return msg;
+			}
+			free(msg);
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Start a message, to be sent by lspSend
+static FILE *lspStart(struct mcasm_ctx *ctx, char **buf, size_t *len) {
+	FILE *f = open_memstream(buf, len);
+	if (f == NULL)
+		print(ctx, FATAL, "Out of memory writing a message\n");
+	fputs("{\"jsonrpc\":\"2.0\",", f);
+	return f;
+}
+static void lspSend(struct mcasm_ctx *ctx, FILE *f, char **buf, size_t *len) {
+	fputc('}', f);
+	fclose(f);
+	fprintf(ctx->lsp->out, "Content-Length: %zu\r\n\r\n", *len);
+	fwrite(*buf, 1, *len, ctx->lsp->out);
+	fflush(ctx->lsp->out);
+	free(*buf);
+}
+// Start the reply to the request with id, the id's JSON
+static FILE *lspReply(struct mcasm_ctx *ctx, const char *id, char **buf,
+					  size_t *len) {
+	FILE *f = lspStart(ctx, buf, len);
+	const char *end = jsonSkip(id);
+	fprintf(f, "\"id\":%.*s,", end ? (int)(end - id) : 4, end ? id : "null");
+	return f;
+}
+
+// The path of a file URI, percent decoded into a malloced string, or NULL
+static char *uriPath(const char *uri) {
+	char *path, *o;
+	unsigned c;
+	if (uri == NULL || strncmp(uri, "file://", 7) != 0)
+		return NULL;
+	uri = strchr(uri + 7, '/'); // past the host
+	if (uri == NULL || (path = o = malloc(strlen(uri) + 1)) == NULL)
+		return NULL;
+	for (; *uri; uri++)
+		if (*uri == '%' && sscanf(uri + 1, "%2x", &c) == 1)
+			*o++ = c, uri += 2;
+		else
+			*o++ = *uri;
+	*o = '\0';
+	return path;
+}
+
+// A file URI of path, malloced
+static char *pathUri(const char *path) {
+	char *uri = malloc(strlen(path) * 3 + 8), *o;
+	if (uri == NULL)
+		return NULL;
+	o = uri + sprintf(uri, "file://");
+	for (; *path; path++)
+		if (isalnum((unsigned char)*path) || strchr("/-._~", *path))
+			*o++ = *path;
+		else
+			o += sprintf(o, "%%%02X", (unsigned char)*path);
+	*o = '\0';
+	return uri;
+}
+
+// Read a file into a malloced buffer, returning NULL if it can't be read
+static char *lspReadFile(struct mcasm_ctx *ctx, const char *name,
+						 size_t *len) {
+	char *text;
+	if (!openSource(ctx, name))
+		return NULL;
+	*len = ctx->src.end - ctx->src.buf;
+	if ((text = malloc(*len + 1)) != NULL)
+		memcpy(text, ctx->src.buf, *len);
+	closeSource(ctx);
+	return text;
+}
+
+static void lspFreeRegions(struct lspRegion *regions, int cnt) {
+	for (int i = 0; i < cnt; i++) {
+		for (int j = 0; j < regions[i].itemCnt; j++)
+			if (regions[i].items[j].kind == LSP_DIAG)
+				free((char *)regions[i].items[j].text);
+		free(regions[i].items);
+	}
+}
+
+static void lspFreeDoc(struct lspDoc *doc) {
+	lspFreeRegions(doc->regions, doc->regionCnt);
+	free(doc->regions);
+	free(doc->name);
+	free(doc->path);
+	free(doc->uri);
+	free(doc->text);
+}
+
+// Add a document after the others, taking text, and return its index
+static int lspAddDoc(struct mcasm_ctx *ctx, const char *name, char *text,
+					 size_t len, bool isInput) {
+	struct lsp *l = ctx->lsp;
+	struct lspDoc *doc;
+	if (l->docCnt == l->docCap) {
+		l->docCap = l->docCap ? l->docCap * 2 : 8;
+		if ((l->docs = realloc(l->docs, l->docCap * sizeof(*doc))) == NULL)
+			print(ctx, FATAL, "Out of memory adding %s\n", name);
+	}
+	doc = memset(&l->docs[l->docCnt], 0, sizeof(*doc));
+	doc->name = strdup(name);
+	doc->path = realpath(name, NULL);
+	doc->uri = pathUri(doc->path ? doc->path : name);
+	doc->text = text;
+	doc->len = len;
+	doc->isInput = isInput;
+	if (doc->name == NULL || doc->uri == NULL || text == NULL)
+		print(ctx, FATAL, "Out of memory adding %s\n", name);
+	return l->docCnt++;
+}
+
+// The document of uri, or -1
+static int lspFindDoc(struct mcasm_ctx *ctx, const char *uri) {
+	struct lsp *l = ctx->lsp;
+	char *path = uriPath(uri), *real = path ? realpath(path, NULL) : NULL;
+	int d;
+	for (d = l->docCnt - 1; d >= 0; d--)
+		if (strcmp(l->docs[d].uri, uri) == 0 ||
+			(real && l->docs[d].path && strcmp(l->docs[d].path, real) == 0))
+			break;
+	free(path);
+	free(real);
+	return d;
+}
+
+/* Set the symbols, ports and settings to those region r of doc d starts from.
+ * The tables usually hold them, and more, from the last parse; if not, the
+ * definitions and forgets of the regions before it are replayed.
+ */
+static void lspRestore(struct mcasm_ctx *ctx, int d, int r) {
+	struct lsp *l = ctx->lsp;
+	const struct lspRegion *at =
+		r < l->docs[d].regionCnt ? &l->docs[d].regions[r] : NULL;
+	if (r > 0) {
+		const struct lspRegion *reg = &l->docs[d].regions[r];
+		ctx->cmdSet = reg->cmdSet, ctx->page = reg->page;
+		ctx->export = reg->export;
+	} else if (d > 0) {
+		const struct lspDoc *prev = &l->docs[d - 1];
+		ctx->cmdSet = prev->cmdSet, ctx->page = prev->page;
+		ctx->export = prev->export;
+	} else
+		ctx->cmdSet = ctx->page = ctx->export = 0;
+	if (at && ctx->symbols.count >= at->symCnt &&
+		ctx->ports.count >= at->portCnt) {
+		releaseSymbols(&ctx->symbols, at->symCnt);
+		releaseSymbols(&ctx->ports, at->portCnt);
+		if (stateHash(ctx) == at->state)
+			return;
+	}
+	releaseSymbols(&ctx->symbols, 0);
+	releaseSymbols(&ctx->ports, 0);
+	for (int i = 0; i <= d; i++)
+		for (int j = 0; j < (i < d ? l->docs[i].regionCnt : r); j++) {
+			const struct lspRegion *reg = &l->docs[i].regions[j];
+			for (int k = 0; k < reg->itemCnt && reg->defCnt; k++) {
+				const struct lspItem *item = &reg->items[k];
+				if (item->kind == LSP_DEF)
+					pushSymbol(ctx, item->isPort ? &ctx->ports : &ctx->symbols,
+							   item->text, item->value);
+				else if (item->kind == LSP_FORGET)
+					releaseSymbols(&ctx->symbols, item->pos);
+			}
+		}
+}
+
+/* Parse doc d from region r, in the state it starts from, until reaching an
+ * old region, from keep on and with its offset moved by shift, that starts
+ * from the same state it did. It and those after it are kept, moved by shift
+ * and lineShift, and true returned; otherwise the regions from r are all
+ * replaced.
+ */
+static bool lspParse(struct mcasm_ctx *ctx, int d, int r, int keep,
+					 long shift, int lineShift) {
+	struct lsp *l = ctx->lsp;
+	struct lspDoc *doc = &l->docs[d];
+	struct lspRegion *fresh = NULL;
+	int freshCnt = 0, k = keep, cnt;
+	bool synced = false;
+	ctx->fileName = doc->name;
+	ctx->src.buf = doc->text;
+	ctx->src.end = doc->text + doc->len;
+	ctx->src.cur =
+		doc->text + (r < doc->regionCnt ? doc->regions[r].offset : 0);
+	ctx->src.isBorrowed = true;
+	ctx->line = r < doc->regionCnt ? doc->regions[r].line : 1;
+	ctx->col = 1;
+	ctx->pushedWord = NULL;
+	ctx->parsing = true;
+	l->tokenCnt = 0;
+	for (;;) {
+		const char *word;
+		long at = ctx->src.cur - doc->text;
+		if (ctx->pushedWord == NULL && (at == 0 || ctx->src.cur[-1] == '\n') &&
+			(l->region == NULL || l->cur.hasStmt)) {
+			if (l->region) {
+				if ((fresh = realloc(fresh, (freshCnt + 1) * sizeof(*fresh))) ==
+					NULL)
+					print(ctx, FATAL, "Out of memory parsing %s\n", doc->name);
+				fresh[freshCnt++] = l->cur;
+				l->region = NULL;
+			}
+			if ((size_t)at == doc->len)
+				break;
+			while (k < doc->regionCnt &&
+				   (long)doc->regions[k].offset + shift < at)
+				k++;
+			if (k < doc->regionCnt &&
+				(long)doc->regions[k].offset + shift == at &&
+				doc->regions[k].state == stateHash(ctx)) {
+				synced = true;
+				break;
+			}
+			memset(&l->cur, 0, sizeof(l->cur));
+			l->cur.offset = at;
+			l->cur.line = ctx->line;
+			l->cur.state = stateHash(ctx);
+			l->cur.symCnt = ctx->symbols.count;
+			l->cur.portCnt = ctx->ports.count;
+			l->cur.cmdSet = ctx->cmdSet, l->cur.page = ctx->page;
+			l->cur.export = ctx->export;
+			l->region = &l->cur;
+			l->parsed++;
+		}
+		if ((word = readWord()) == KW(EOF))
+			break;
+		l->cur.hasStmt |= word != KW(NL);
+		parseStmt(ctx, word);
+		ctx->grpCnt = 0, ctx->testLen = 0;
+	}
+	if (l->region) {
+		if ((fresh = realloc(fresh, (freshCnt + 1) * sizeof(*fresh))) == NULL)
+			print(ctx, FATAL, "Out of memory parsing %s\n", doc->name);
+		fresh[freshCnt++] = l->cur;
+		l->region = NULL;
+	}
+	ctx->parsing = false;
+	closeSource(ctx);
+	if (!synced) {
+		k = doc->regionCnt;
+		doc->cmdSet = ctx->cmdSet, doc->page = ctx->page;
+		doc->export = ctx->export;
+	}
+	// replace the regions from r up to k with those parsed
+	lspFreeRegions(&doc->regions[r], k - r);
+	cnt = r + freshCnt + doc->regionCnt - k;
+	if (cnt > doc->regionCap) {
+		doc->regionCap = cnt * 2;
+		doc->regions =
+			realloc(doc->regions, doc->regionCap * sizeof(*doc->regions));
+		if (doc->regions == NULL)
+			print(ctx, FATAL, "Out of memory parsing %s\n", doc->name);
+	}
+	memmove(&doc->regions[r + freshCnt], &doc->regions[k],
+			(doc->regionCnt - k) * sizeof(*doc->regions));
+	if (freshCnt)
+		memcpy(&doc->regions[r], fresh, freshCnt * sizeof(*fresh));
+	for (int i = r + freshCnt; i < cnt; i++) {
+		doc->regions[i].offset += shift;
+		doc->regions[i].line += lineShift;
+	}
+	doc->regionCnt = cnt;
+	free(fresh);
+	return synced;
+}
+
+/* Parse doc d again, the old text from start to oldEnd having been replaced
+ * by the new to newEnd, and the documents after it as far as the change
+ * reaches
+ */
+static void lspUpdate(struct mcasm_ctx *ctx, int d, size_t start,
+					  size_t oldEnd, size_t newEnd, int lineShift) {
+	struct lspDoc *doc = &ctx->lsp->docs[d];
+	int lo = 0, hi = doc->regionCnt, r, keep;
+	while (lo < hi) { // for the last region starting at or before start
+		int mid = (lo + hi) / 2;
+		if (doc->regions[mid].offset <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	r = lo > 0 ? lo - 1 : 0;
+	for (keep = r; keep < doc->regionCnt && doc->regions[keep].offset < oldEnd;
+		 keep++)
+		;
+	lspRestore(ctx, d, r);
+	if (lspParse(ctx, d, r, keep, (long)newEnd - (long)oldEnd, lineShift))
+		return;
+	while (++d < ctx->lsp->docCnt && !lspParse(ctx, d, 0, 0, 0, 0))
+		;
+}
+
+// Replace the text of doc d with text, and parse what changed
+static void lspSetText(struct mcasm_ctx *ctx, int d, char *text, size_t len) {
+	struct lspDoc *doc = &ctx->lsp->docs[d];
+	size_t pre = 0, suf = 0, oldLen = doc->len;
+	int lineShift = 0;
+	while (pre < oldLen && pre < len && doc->text[pre] == text[pre])
+		pre++;
+	while (suf < oldLen - pre && suf < len - pre &&
+		   doc->text[oldLen - 1 - suf] == text[len - 1 - suf])
+		suf++;
+	for (size_t i = pre; i < oldLen - suf; i++)
+		lineShift -= doc->text[i] == '\n';
+	for (size_t i = pre; i < len - suf; i++)
+		lineShift += text[i] == '\n';
+	free(doc->text);
+	doc->text = text;
+	doc->len = len;
+	if (pre < oldLen || pre < len)
+		lspUpdate(ctx, d, pre, oldLen - suf, len - suf, lineShift);
+}
+
+// Remove doc d, and parse the documents after it as far as that reaches
+static void lspRemoveDoc(struct mcasm_ctx *ctx, int d) {
+	struct lsp *l = ctx->lsp;
+	lspFreeDoc(&l->docs[d]);
+	memmove(&l->docs[d], &l->docs[d + 1],
+			(--l->docCnt - d) * sizeof(struct lspDoc));
+	if (d < l->docCnt)
+		lspRestore(ctx, d, 0);
+	for (; d < l->docCnt && !lspParse(ctx, d, 0, 0, 0, 0); d++)
+		;
+}
+
+// The last region of doc starting at or before line, or -1
+static int lspRegionAt(const struct lspDoc *doc, int line) {
+	int lo = 0, hi = doc->regionCnt;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (doc->regions[mid].line <= line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+// The start of line, from the region's first, of a region of doc
+static const char *lspLineStart(const struct lspDoc *doc,
+								const struct lspRegion *reg, int line) {
+	const char *p = doc->text + reg->offset, *end = doc->text + doc->len;
+	for (const char *nl; line > 0 && (nl = memchr(p, '\n', end - p)); line--)
+		p = nl + 1;
+	return p;
+}
+
+// The UTF-16 code units of the first n bytes of the line at s
+static int utf16Len(const char *s, const char *end, size_t n) {
+	int units = 0;
+	for (size_t i = 0; i < n && s + i < end && s[i] != '\n'; i++) {
+		unsigned char c = s[i];
+		units += (c & 0xc0) != 0x80; // not a continuation byte
+		units += c >= 0xf0;			 // a surrogate pair
+	}
+	return units;
+}
+
+// The bytes of the line at s that hold its first units UTF-16 code units
+static size_t utf8Len(const char *s, const char *end, int units) {
+	size_t n = 0;
+	for (; s + n < end && s[n] != '\n'; n++) {
+		unsigned char c = s[n];
+		if ((c & 0xc0) != 0x80 && (units -= 1 + (c >= 0xf0)) < 0)
+			break;
+	}
+	return n;
+}
+
+static void lspPutRange(FILE *f, const struct lspDoc *doc,
+						const struct lspRegion *reg,
+						const struct lspItem *item) {
+	const char *s = lspLineStart(doc, reg, item->line);
+	const char *end = doc->text + doc->len;
+	int line = reg->line + item->line - 1;
+	fprintf(f,
+			"{\"start\":{\"line\":%d,\"character\":%d},"
+			"\"end\":{\"line\":%d,\"character\":%d}}",
+			line, utf16Len(s, end, item->col - 1), line,
+			utf16Len(s, end, item->col - 1 + item->len));
+}
+
+static void lspPutDiag(FILE *f, const struct lspDoc *doc,
+					   const struct lspRegion *reg,
+					   const struct lspItem *item, int class,
+					   const char *msg, bool first) {
+	fputs(first ? "{\"range\":" : ",{\"range\":", f);
+	lspPutRange(f, doc, reg, item);
+	fprintf(f, ",\"severity\":%d,\"source\":\"mcasm\",\"message\":",
+			class == WARN ? 2 : 1);
+	jsonPutStr(f, msg);
+	fputc('}', f);
+}
+
+/* Publish the diagnostics of every document whose diagnostics changed, with
+ * those of groups that conflict with a group of an earlier document
+ */
+static void lspPublish(struct mcasm_ctx *ctx) {
+	struct lsp *l = ctx->lsp;
+	memset(l->owner, 0, ctx->storeSize / ctx->cmdsPerGrp * sizeof(int));
+	for (int d = 0; d < l->docCnt; d++) {
+		struct lspDoc *doc = &l->docs[d];
+		char *buf, msg[256];
+		size_t len;
+		uint64_t h;
+		bool first = true;
+		FILE *f = lspStart(ctx, &buf, &len);
+		fputs("\"method\":\"textDocument/publishDiagnostics\","
+			  "\"params\":{\"uri\":",
+			  f);
+		jsonPutStr(f, doc->uri);
+		fputs(",\"diagnostics\":[", f);
+		for (int r = 0; r < doc->regionCnt; r++)
+			for (int i = 0, n = 0; n < doc->regions[r].markCnt; i++) {
+				const struct lspItem *item = &doc->regions[r].items[i];
+				int g = item->pos / ctx->cmdsPerGrp;
+				n += item->kind == LSP_DIAG || item->kind == LSP_GROUP;
+				if (item->kind == LSP_DIAG)
+					lspPutDiag(f, doc, &doc->regions[r], item, item->value,
+							   item->text, first);
+				else if (item->kind != LSP_GROUP)
+					continue;
+				else if (l->owner[g] && l->owner[g] != d + 1) {
+					snprintf(msg, sizeof(msg),
+							 "Command group %d:%d:%d in %s conflicts with the "
+							 "group in %s",
+							 g >> (ctx->geo.pageBits + ctx->geo.cmdBits),
+							 (g >> ctx->geo.cmdBits) &
+								 SET_BITS(ctx->geo.pageBits),
+							 g & SET_BITS(ctx->geo.cmdBits), doc->name,
+							 l->docs[l->owner[g] - 1].name);
+					lspPutDiag(f, doc, &doc->regions[r], item, ERROR, msg,
+							   first);
+				} else {
+					l->owner[g] = d + 1;
+					continue;
+				}
+				first = false;
+				if (item->kind == LSP_GROUP)
+					l->owner[g] = d + 1;
+			}
+		fputs("]}", f);
+		fflush(f);
+		h = hash64(0xcbf29ce484222325ull, buf, len);
+		if (doc->isPublished && h == doc->published) {
+			fclose(f);
+			free(buf);
+			continue;
+		}
+		doc->isPublished = true;
+		doc->published = h;
+		lspSend(ctx, f, &buf, &len);
+	}
+}
+
+// Clear the diagnostics of a document that is going away
+static void lspUnpublish(struct mcasm_ctx *ctx, const struct lspDoc *doc) {
+	char *buf;
+	size_t len;
+	FILE *f = lspStart(ctx, &buf, &len);
+	fputs("\"method\":\"textDocument/publishDiagnostics\","
+		  "\"params\":{\"uri\":",
+		  f);
+	jsonPutStr(f, doc->uri);
+	fputs(",\"diagnostics\":[]}", f);
+	lspSend(ctx, f, &buf, &len);
+}
+
+/* The symbol at the position of a request's params, and the command on its
+ * line, or NULL, setting *d and *r to its document and region
+ */
+static const struct lspItem *lspItemAt(struct mcasm_ctx *ctx,
+									   const char *params, int *d, int *r,
+									   const struct lspItem **cmd) {
+	struct lsp *l = ctx->lsp;
+	char *uri = jsonString(jsonPath(params, "textDocument", "uri", NULL), NULL);
+	int line = jsonInt(jsonPath(params, "position", "line", NULL)) + 1;
+	int units = jsonInt(jsonPath(params, "position", "character", NULL));
+	const struct lspItem *sym = NULL;
+	const struct lspDoc *doc;
+	const struct lspRegion *reg;
+	const char *s;
+	int col;
+	*cmd = NULL;
+	*d = uri ? lspFindDoc(ctx, uri) : -1;
+	free(uri);
+	if (*d < 0 || (doc = &l->docs[*d])->regionCnt == 0)
+		return NULL;
+	if ((*r = lspRegionAt(doc, line)) < 0)
+		*r = 0;
+	reg = &doc->regions[*r];
+	line -= reg->line;
+	s = lspLineStart(doc, reg, line);
+	col = utf8Len(s, doc->text + doc->len, units) + 1;
+	for (int i = 0; i < reg->itemCnt; i++) {
+		const struct lspItem *item = &reg->items[i];
+		if (item->line != line)
+			continue;
+		if (item->kind == LSP_CMD)
+			*cmd = item;
+		else if ((item->kind == LSP_DEF || item->kind == LSP_REF) &&
+				 sym == NULL && col >= item->col && col < item->col + item->len)
+			sym = item;
+	}
+	return sym;
+}
+
+/* The definition of the symbol of item, in region *r of doc *d, setting *d
+ * and *r to where it is, or NULL
+ */
+static const struct lspItem *lspFindDef(struct lsp *l, int *d, int *r,
+										const struct lspItem *item) {
+	if (item->kind == LSP_DEF)
+		return item;
+	for (int i = *d; i >= 0; i--)
+		for (int j = i == *d ? *r : l->docs[i].regionCnt - 1; j >= 0; j--) {
+			const struct lspRegion *reg = &l->docs[i].regions[j];
+			int k = i == *d && j == *r ? item - reg->items : reg->itemCnt;
+			while (--k >= 0) {
+				const struct lspItem *def = &reg->items[k];
+				if (def->kind == LSP_DEF && def->text == item->text &&
+					def->isPort == item->isPort && def->pos == item->pos) {
+					*d = i, *r = j;
+					return def;
+				}
+			}
+		}
+	return NULL;
+}
+
+// Reply with the value of the symbol and the command at the position
+static void lspHover(struct mcasm_ctx *ctx, const char *id,
+					 const char *params) {
+	const struct lspItem *cmd, *sym;
+	char *buf, text[512], bits[2][16];
+	size_t len;
+	int d, r, n = 0;
+	FILE *f = lspReply(ctx, id, &buf, &len);
+	sym = lspItemAt(ctx, params, &d, &r, &cmd);
+	if (sym && sym->isPort) {
+		formatBinary(ctx, bits[0], "cccc_cc", sym->value);
+		n = sprintf(text, "port `%s` = %d `0b%s`", sym->text, sym->value,
+					bits[0]);
+	} else if (sym)
+		n = sprintf(text, "symbol `%s` = %d `0x%x`", sym->text, sym->value,
+					sym->value);
+	if (cmd) {
+		formatBinary(ctx, bits[0], "cccc_cc", cvDSpec(cmd->value));
+		formatBinary(ctx, bits[1], "cccc_cc", cvSSpec(cmd->value));
+		n += sprintf(text + n, "%s`0x%04x`: `0x%04x` dSpec `0b%s`",
+					 n ? "\n\n" : "", cmd->pos, cmd->value, bits[0]);
+		if (cvIsImm(cmd->value))
+			sprintf(text + n, " immediate %d", cvImm(cmd->value));
+		else
+			sprintf(text + n, " sSpec `0b%s`%s", bits[1],
+					cvTst(cmd->value) == CMD_TST ? " test" : "");
+	}
+	if (sym || cmd) {
+		fputs("\"result\":{\"contents\":{\"kind\":\"markdown\",\"value\":", f);
+		jsonPutStr(f, text);
+		fputc('}', f);
+		if (sym) {
+			fputs(",\"range\":", f);
+			lspPutRange(f, &ctx->lsp->docs[d], &ctx->lsp->docs[d].regions[r],
+						sym);
+		}
+		fputc('}', f);
+	} else
+		fputs("\"result\":null", f);
+	lspSend(ctx, f, &buf, &len);
+}
+
+// Reply with where the symbol at the position is defined
+static void lspDefinition(struct mcasm_ctx *ctx, const char *id,
+						  const char *params) {
+	struct lsp *l = ctx->lsp;
+	const struct lspItem *cmd, *sym, *def = NULL;
+	char *buf;
+	size_t len;
+	int d, r;
+	FILE *f = lspReply(ctx, id, &buf, &len);
+	if ((sym = lspItemAt(ctx, params, &d, &r, &cmd)) != NULL)
+		def = lspFindDef(l, &d, &r, sym);
+	if (def) {
+		fputs("\"result\":{\"uri\":", f);
+		jsonPutStr(f, l->docs[d].uri);
+		fputs(",\"range\":", f);
+		lspPutRange(f, &l->docs[d], &l->docs[d].regions[r], def);
+		fputc('}', f);
+	} else
+		fputs("\"result\":null", f);
+	lspSend(ctx, f, &buf, &len);
+}
+
+// The offset in doc of the position at pos, its line and character from 0
+static size_t lspOffset(const struct lspDoc *doc, const char *pos) {
+	long line = jsonInt(jsonGet(pos, "line")) + 1;
+	int r = lspRegionAt(doc, line);
+	const char *p = doc->text + (r < 0 ? 0 : doc->regions[r].offset);
+	const char *end = doc->text + doc->len;
+	line -= r < 0 ? 1 : doc->regions[r].line;
+	for (const char *nl; line > 0 && (nl = memchr(p, '\n', end - p)); line--)
+		p = nl + 1;
+	return p - doc->text + utf8Len(p, end, jsonInt(jsonGet(pos, "character")));
+}
+
+// Apply each change in turn, parsing what it changed before the next
+static void lspDidChange(struct mcasm_ctx *ctx, const char *params) {
+	char *uri = jsonString(jsonPath(params, "textDocument", "uri", NULL), NULL);
+	int d = uri ? lspFindDoc(ctx, uri) : -1;
+	struct lspDoc *doc = d >= 0 ? &ctx->lsp->docs[d] : NULL;
+	free(uri);
+	for (const char *c = jsonFirst(jsonGet(params, "contentChanges")); doc && c;
+		 c = jsonNext(c)) {
+		const char *range = jsonGet(c, "range");
+		size_t len, from, to;
+		char *text = jsonString(jsonGet(c, "text"), &len);
+		int lineShift = 0;
+		if (text == NULL || range == NULL) {
+			if (text)
+				lspSetText(ctx, d, text, len);
+			continue;
+		}
+		from = lspOffset(doc, jsonGet(range, "start"));
+		if ((to = lspOffset(doc, jsonGet(range, "end"))) < from)
+			to = from;
+		for (size_t i = from; i < to; i++)
+			lineShift -= doc->text[i] == '\n';
+		for (size_t i = 0; i < len; i++)
+			lineShift += text[i] == '\n';
+		if (len > to - from &&
+			(doc->text = realloc(doc->text, doc->len + len - (to - from))) ==
+				NULL)
+			print(ctx, FATAL, "Out of memory changing %s\n", doc->name);
+		memmove(doc->text + from + len, doc->text + to, doc->len - to);
+		memcpy(doc->text + from, text, len);
+		doc->len += len - (to - from);
+		free(text);
+		lspUpdate(ctx, d, from, to, from + len, lineShift);
+	}
+}
+
+static void lspDidOpen(struct mcasm_ctx *ctx, const char *params) {
+	const char *item = jsonGet(params, "textDocument");
+	char *uri = jsonString(jsonGet(item, "uri"), NULL), *path;
+	size_t len;
+	char *text = jsonString(jsonGet(item, "text"), &len);
+	int d;
+	if (uri == NULL || text == NULL) {
+		free(uri);
+		free(text);
+		return;
+	}
+	if ((d = lspFindDoc(ctx, uri)) >= 0) {
+		free(ctx->lsp->docs[d].uri);
+		ctx->lsp->docs[d].uri = uri; // as the client spells it
+		lspSetText(ctx, d, text, len);
+		return;
+	}
+	path = uriPath(uri);
+	d = lspAddDoc(ctx, path ? path : uri, text, len, false);
+	free(ctx->lsp->docs[d].uri);
+	ctx->lsp->docs[d].uri = uri;
+	free(path);
+	lspUpdate(ctx, d, 0, 0, len, 0);
+}
+
+// An input goes back to the text of its file, other documents are dropped
+static void lspDidClose(struct mcasm_ctx *ctx, const char *params) {
+	char *uri = jsonString(jsonPath(params, "textDocument", "uri", NULL), NULL);
+	int d = uri ? lspFindDoc(ctx, uri) : -1;
+	struct lspDoc *doc = d >= 0 ? &ctx->lsp->docs[d] : NULL;
+	char *text;
+	size_t len;
+	free(uri);
+	if (doc && !doc->isInput) {
+		lspUnpublish(ctx, doc);
+		lspRemoveDoc(ctx, d);
+	} else if (doc && (text = lspReadFile(ctx, doc->name, &len)) != NULL)
+		lspSetText(ctx, d, text, len);
+}
+
+/* Serve the client until it exits, the inputs being the documents assembled
+ * first, in their order, and those it opens after them
+ */
+static bool serveLsp(struct mcasm_ctx *ctx, FILE *in, FILE *out) {
+	struct lsp *l = calloc(1, sizeof(struct lsp));
+	char *msg;
+	if (l == NULL || (l->owner = calloc(ctx->storeSize / ctx->cmdsPerGrp,
+										sizeof(int))) == NULL)
+		print(ctx, FATAL, "Out of memory starting the language server\n");
+	ctx->lsp = l;
+	l->out = out;
+	ctx->optimize = false;
+	ctx->grpCache.path = NULL;
+	for (int i = 0; i < ctx->inputCnt; i++) {
+		const struct input *input = &ctx->inputs[i];
+		size_t len = input->len;
+		char *text = input->text ? malloc(len + 1)
+								 : lspReadFile(ctx, input->name, &len);
+		if (input->text && text)
+			memcpy(text, input->text, len);
+		else if (text == NULL && !input->text) {
+			print(ctx, WARN, "Can't read %s\n", input->name);
+			text = calloc(1, 1), len = 0;
+		}
+		lspAddDoc(ctx, input->name, text, len, true);
+	}
+	ctx->inputCnt = 0;
+	for (int d = 0; d < l->docCnt; d++)
+		lspParse(ctx, d, 0, 0, 0, 0);
+	while ((msg = lspRead(in)) != NULL) {
+		const char *id = jsonGet(msg, "id"), *params = jsonGet(msg, "params");
+		char *method = jsonString(jsonGet(msg, "method"), NULL), *buf;
+		struct timespec start, end;
+		int parsed = l->parsed;
+		size_t len;
+		FILE *f;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (method == NULL)
+			;
+		else if (strcmp(method, "initialize") == 0) {
+			f = lspReply(ctx, id, &buf, &len);
+			fputs("\"result\":{\"capabilities\":{"
+				  "\"positionEncoding\":\"utf-16\","
+				  "\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+				  "\"hoverProvider\":true,\"definitionProvider\":true},"
+				  "\"serverInfo\":{\"name\":\"mcasm\"}}",
+				  f);
+			lspSend(ctx, f, &buf, &len);
+		} else if (strcmp(method, "initialized") == 0)
+			lspPublish(ctx);
+		else if (strcmp(method, "shutdown") == 0) {
+			l->shutdown = true;
+			f = lspReply(ctx, id, &buf, &len);
+			fputs("\"result\":null", f);
+			lspSend(ctx, f, &buf, &len);
+		} else if (strcmp(method, "exit") == 0) {
+			free(method);
+			free(msg);
+			return l->shutdown;
+		} else if (strcmp(method, "textDocument/didOpen") == 0)
+			lspDidOpen(ctx, params);
+		else if (strcmp(method, "textDocument/didChange") == 0)
+			lspDidChange(ctx, params);
+		else if (strcmp(method, "textDocument/didClose") == 0)
+			lspDidClose(ctx, params);
+		else if (strcmp(method, "textDocument/hover") == 0)
+			lspHover(ctx, id, params);
+		else if (strcmp(method, "textDocument/definition") == 0)
+			lspDefinition(ctx, id, params);
+		else if (id) {
+			f = lspReply(ctx, id, &buf, &len);
+			fputs("\"error\":{\"code\":-32601,\"message\":\"Unknown method\"}",
+				  f);
+			lspSend(ctx, f, &buf, &len);
+		}
+		if (method && strncmp(method, "textDocument/did", 16) == 0) {
+			lspPublish(ctx);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (ctx->stats || ctx->profile)
+				fprintf(ctx->diag, "%s: %d regions parsed in %.3f ms\n",
+						method + 13, l->parsed - parsed,
+						(end.tv_sec - start.tv_sec) * 1e3 +
+							(end.tv_nsec - start.tv_nsec) / 1e6);
+		}
+		free(method);
+		free(msg);
+	}
+	return false;
+}
+
+static void lspFree(struct mcasm_ctx *ctx) {
+	struct lsp *l = ctx->lsp;
+	if (l == NULL)
+		return;
+	for (int d = 0; d < l->docCnt; d++)
+		lspFreeDoc(&l->docs[d]);
+	lspFreeRegions(&l->cur, l->region != NULL);
+	free(l->docs);
+	free(l->owner);
+	free(l);
+	ctx->lsp = NULL;
+}
+
+// Write the image assembled so far, unless assembling it failed
+static void finishOutputFile(struct mcasm_ctx *ctx, int first) {
+	if (ctx->outputName == NULL)
+		return;
+	assembleInputs(ctx, first);
+	if (ctx->exitStatus == EXIT_SUCCESS) {
+		enterPhase(ctx, PH_OUTPUT);
+		if (ctx->shareTails)
+			shareTails(ctx);
+		writeOutputFile(ctx);
+		if (ctx->costFile)
+			writeCosts(ctx);
+		enterPhase(ctx, PH_PARSE);
+	} else
+		print(ctx, WARN, "%s not written due to errors\n", ctx->outputName);
+	ctx->testLen = 0;
+	memset(ctx->image, 0, ctx->storeSize * sizeof(uint16_t));
+	memset(ctx->grpOwner, 0,
+		   ctx->storeSize / ctx->cmdsPerGrp * sizeof(const char *));
+}
+
+/* Variants of an image are assembled by forked processes, each from the state
+ * left by the inputs before the first that names a symbol any variant defines.
+ * Those are assembled once, by the parent, which forks every variant there.
+ * Each waits to be told to go, so that -j run at once, the parent assembling
+ * the image of the output file being one of them.
+ */
+struct variantJob {
+	pid_t pid;
+	int go;		 // the write end of the pipe it waits on
+	FILE *err;	 // its diagnostics
+	FILE *stats; // its counts, a struct variantStats, once it succeeds
+};
+struct variantStats {
+	int exitStatus;
+	long tokenCnt, groupCnt, stepsSaved, stepsReclaimed;
+	int hits, misses;
+};
+
+// The length of the name of the define NAME=value, 0 if it isn't one
+static int defineNameLen(const char *define) {
+	const char *eq = strchr(define, '=');
+	return eq && eq[1] ? eq - define : 0;
+}
+
+/* Mark in named, one for each define of the variants in turn, those an input
+ * names in any token, returning how many it is the first to name. An input
+ * that can't be read names none, and is reported when it is assembled.
+ */
+static int namesDefines(struct mcasm_ctx *ctx, const struct input *in,
+						const struct mcasm_variant *variants, int cnt,
+						bool *named) {
+	const char *p = NULL, *end = NULL, *start;
+	bool opened = !in->text && openSource(ctx, in->name);
+	int n = 0;
+	if (in->text)
+		p = in->text, end = in->text + in->len;
+	else if (opened)
+		p = ctx->src.buf, end = ctx->src.end;
+	while (p < end) {
+		while (p < end && charClass[(unsigned char)*p] <= C_NL)
+			p++;
+		for (start = p; p < end && charClass[(unsigned char)*p] > C_NL; p++)
+			;
+		for (int i = 0, k = 0; i < cnt; i++)
+			for (int j = 0; j < variants[i].defineCnt; j++, k++) {
+				const char *d = variants[i].defines[j];
+				if (!named[k] && defineNameLen(d) == p - start &&
+					memcmp(d, start, p - start) == 0)
+					named[k] = true, n++;
+			}
+	}
+	if (opened)
+		closeSource(ctx);
+	return n;
+}
+
+/* Fork a process to assemble the variant jobs[i] from the inputs from first
+ * on, once it is told to go. It exits if the parent does first.
+ */
+static void forkVariant(struct mcasm_ctx *ctx, struct variantJob *jobs, int i,
+						const struct mcasm_variant *v, int first) {
+	struct variantJob *job = &jobs[i];
+	struct variantStats st;
+	int fds[2];
+	char go;
+	fflush(ctx->diag);
+	job->err = tmpfile();
+	job->stats = tmpfile();
+	if (job->err == NULL || job->stats == NULL || pipe(fds) != 0)
+		print(ctx, FATAL, "Can't create temporary files for %s\n", v->output);
+	job->go = fds[1];
+	job->pid = fork();
+	if (job->pid < 0)
+		print(ctx, FATAL, "Can't fork to assemble %s\n", v->output);
+	if (job->pid > 0) {
+		close(fds[0]);
+		return;
+	}
+	for (int j = 0; j <= i; j++)
+		close(jobs[j].go);
+	if (read(fds[0], &go, 1) != 1)
+		_exit(EXIT_FAILURE);
+	close(fds[0]);
+	ctx->isVariant = true;
+	ctx->diag = job->err;
+	ctx->listFile = ctx->costFile = ctx->mapFile = NULL;
+	ctx->snapshotDir = NULL;
+	ctx->jobs = 1;
+	ctx->tokenCnt = ctx->groupCnt = ctx->stepsSaved = ctx->stepsReclaimed = 0;
+	ctx->grpCache.hits = ctx->grpCache.misses = 0;
+	ctx->outputName = v->output;
+	if (v->defineCnt > 0 &&
+		(ctx->overrides = malloc(v->defineCnt * sizeof(struct override))) ==
+			NULL)
+		print(ctx, FATAL, "Out of memory assembling %s\n", v->output);
+	for (int k = 0; k < v->defineCnt; k++) {
+		const char *d = v->defines[k];
+		int len = defineNameLen(d);
+		struct override *o = &ctx->overrides[k];
+		o->id = intern(ctx, d, len);
+		o->value = deriveSymbolValue(
+			ctx, intern(ctx, d + len + 1, strlen(d + len + 1)));
+		addSymbol(ctx, o->id, o->value);
+	}
+	ctx->overrideCnt = v->defineCnt;
+	finishOutputFile(ctx, first);
+	st.exitStatus = ctx->exitStatus;
+	st.tokenCnt = ctx->tokenCnt, st.groupCnt = ctx->groupCnt;
+	st.stepsSaved = ctx->stepsSaved, st.stepsReclaimed = ctx->stepsReclaimed;
+	st.hits = ctx->grpCache.hits, st.misses = ctx->grpCache.misses;
+	fwrite(&st, sizeof(st), 1, job->stats);
+	fclose(job->stats);
+	fflush(ctx->diag);
+	_exit(EXIT_SUCCESS);
+}
+
+// Wait for the variant to be assembled and add its diagnostics and counts
+static void finishVariant(struct mcasm_ctx *ctx, struct variantJob *job,
+						  const struct mcasm_variant *v) {
+	struct variantStats st;
+	int status;
+	enterPhase(ctx, PH_WAIT);
+	waitpid(job->pid, &status, 0);
+	enterPhase(ctx, PH_PARSE);
+	copyDiagnostics(ctx, job->err);
+	rewind(job->stats);
+	if (fread(&st, sizeof(st), 1, job->stats) == 1) {
+		if (st.exitStatus != EXIT_SUCCESS)
+			ctx->exitStatus = st.exitStatus;
+		ctx->tokenCnt += st.tokenCnt, ctx->groupCnt += st.groupCnt;
+		ctx->stepsSaved += st.stepsSaved;
+		ctx->stepsReclaimed += st.stepsReclaimed;
+		ctx->grpCache.hits += st.hits, ctx->grpCache.misses += st.misses;
+	} else
+		print(ctx, ERROR, "%s not written, assembling it failed\n",
+			  v->output);
+	fclose(job->err);
+	fclose(job->stats);
+}
+
+static void startVariant(struct mcasm_ctx *ctx, struct variantJob *job) {
+	if (write(job->go, "", 1) != 1)
+		print(ctx, ERROR, "Can't start a variant\n");
+	close(job->go);
+}
+
+// Write the image of the inputs to the output file, and of each variant
+static void writeVariants(struct mcasm_ctx *ctx,
+						  const struct mcasm_variant *variants, int cnt) {
+	struct variantJob *jobs = calloc(cnt, sizeof(struct variantJob));
+	int first = 0, next = 0, defineCnt = 0, namedCnt = 0;
+	bool *named;
+	for (int i = 0; i < cnt; i++)
+		defineCnt += variants[i].defineCnt;
+	named = calloc(defineCnt, sizeof(bool));
+	if (jobs == NULL || (defineCnt > 0 && named == NULL))
+		print(ctx, FATAL, "Out of memory assembling the variants\n");
+	for (int i = 0; i < cnt; i++)
+		for (int j = 0; j < variants[i].defineCnt; j++)
+			if (defineNameLen(variants[i].defines[j]) == 0)
+				print(ctx, FATAL, "Expected NAME=value for %s, not %s\n",
+					  variants[i].output, variants[i].defines[j]);
+	startListing(ctx);
+	while (first < ctx->inputCnt &&
+		   (namedCnt = namesDefines(ctx, &ctx->inputs[first], variants, cnt,
+									named)) == 0)
+		assembleInput(ctx, &ctx->inputs[first++]);
+	// the rest are only scanned until every define is named
+	for (int i = first + 1; i < ctx->inputCnt && namedCnt < defineCnt; i++)
+		namedCnt += namesDefines(ctx, &ctx->inputs[i], variants, cnt, named);
+	for (int i = 0, k = 0; i < cnt; i++)
+		for (int j = 0; j < variants[i].defineCnt; j++, k++)
+			if (!named[k])
+				print(ctx, WARN, "No input names %.*s, so -D %s for %s does "
+								 "nothing\n",
+					  defineNameLen(variants[i].defines[j]),
+					  variants[i].defines[j], variants[i].defines[j],
+					  variants[i].output);
+	free(named);
+	for (int i = 0; i < cnt; i++)
+		forkVariant(ctx, jobs, i, &variants[i], first);
+	// the parent is one of the jobs, assembling the output file
+	for (; next < cnt && next < (ctx->jobs > 1 ? ctx->jobs - 1 : 1); next++)
+		startVariant(ctx, &jobs[next]);
+	if (first == 0 && ctx->inputCnt > 0) // the listing has been started
+		assembleInput(ctx, &ctx->inputs[first++]);
+	finishOutputFile(ctx, first);
+	for (int i = 0; i < cnt; i++) {
+		finishVariant(ctx, &jobs[i], &variants[i]);
+		if (next < cnt)
+			startVariant(ctx, &jobs[next++]);
+	}
+	free(jobs);
+}
+
+/* Print statistics for the run as a single line of name=value pairs, so
+ * benchmarks can parse them. Peak RSS includes the -j workers.
+ */
+static void printStats(struct mcasm_ctx *ctx) {
+	const struct timespec *start = &ctx->start;
+	struct timespec end;
+	struct rusage self, children;
+	double secs;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+	fprintf(ctx->diag,
+			"stats: tokens=%ld groups=%ld seconds=%.6f tokens_per_sec=%.0f "
+			"groups_per_sec=%.0f peak_rss_kb=%ld cache_hits=%d "
+			"cache_misses=%d steps_saved=%ld steps_reclaimed=%ld\n",
+			ctx->tokenCnt, ctx->groupCnt, secs,
+			secs > 0 ? ctx->tokenCnt / secs : 0,
+			secs > 0 ? ctx->groupCnt / secs : 0,
+			self.ru_maxrss > children.ru_maxrss ? self.ru_maxrss
+												: children.ru_maxrss,
+			ctx->grpCache.hits, ctx->grpCache.misses, ctx->stepsSaved,
+			ctx->stepsReclaimed);
+}
+
+/* Print the time spent in each phase and the work counters, including the
+ * work of -j workers, as a table or as JSON
+ */
+static void printProfile(struct mcasm_ctx *ctx) {
+	bool json = ctx->profile == MCASM_PROFILE_JSON;
+	enterPhase(ctx, ctx->phase);
+	fprintf(ctx->diag, json ? "{\"phases\": {" : "%-10s %10s\n", "phase",
+			"seconds");
+	for (int i = 0; i < PHASE_CNT; i++)
+		fprintf(ctx->diag, json ? "%s\"%s\": %.6f" : "%s%-10s %10.6f\n",
+				json && i ? ", " : "", phaseNames[i], ctx->prof.secs[i]);
+	fprintf(ctx->diag,
+			json ? "}, \"tokens\": %ld, \"internProbes\": %ld, "
+				   "\"lookups\": %ld, \"groups\": %ld, "
+				   "\"bytesWritten\": %ld}\n"
+				 : "tokens        %ld\ninternProbes  %ld\nlookups       %ld\n"
+				   "groups        %ld\nbytesWritten  %ld\n",
+			ctx->tokenCnt, ctx->prof.internProbes, ctx->prof.lookups,
+			ctx->groupCnt, ctx->prof.bytesWritten);
+}
+
+/* The library interface, see mcasm.h. A fatal error longjmps back to the
+ * interface function that was called, which fails.
+ */
+#define CATCH_FATAL(value)           \
+	do {                             \
+		if (ctx->failed)             \
+			return value;            \
+		if (setjmp(ctx->fatal) != 0) \
+			return value;            \
+	} while (0)
+
+// Check the geometry and make an empty image of its size
+static void setGeometry(struct mcasm_ctx *ctx) {
+	static const struct mcasm_geometry defaults = {CMDSET_BITS, PAGE_BITS,
+												   CMD_BITS, STEP_BITS};
+	struct mcasm_geometry *g = &ctx->geo;
+	if (!g->cmdSetBits && !g->pageBits && !g->cmdBits && !g->stepBits)
+		*g = defaults;
+	if (g->cmdSetBits < 0 || g->pageBits < 0 || g->cmdBits < 1 ||
+		g->stepBits < 1 || g->stepBits > MAX_STEP_BITS ||
+		g->cmdSetBits + g->pageBits + g->cmdBits + g->stepBits > MAX_ADDR_BITS)
+		print(ctx, FATAL,
+			  "Invalid geometry %d:%d:%d:%d, steps are 1 to %d bits and "
+			  "addresses at most %d\n",
+			  g->cmdSetBits, g->pageBits, g->cmdBits, g->stepBits,
+			  MAX_STEP_BITS, MAX_ADDR_BITS);
+	ctx->cmdsPerGrp = 1 << g->stepBits;
+	ctx->storeSize =
+		1 << (g->cmdSetBits + g->pageBits + g->cmdBits + g->stepBits);
+	ctx->image = calloc(ctx->storeSize, sizeof(uint16_t));
+	ctx->grpOwner =
+		calloc(ctx->storeSize / ctx->cmdsPerGrp, sizeof(const char *));
+	if (ctx->image == NULL || ctx->grpOwner == NULL)
+		print(ctx, FATAL, "Out of memory for a store of %d commands\n",
+			  ctx->storeSize);
+}
+
+// Intern the keywords and load the group cache, as a new context starts
+static bool startContext(struct mcasm_ctx *ctx, const char *cache) {
+	CATCH_FATAL(false);
+	setGeometry(ctx);
+	for (int i = 0; i < KEYWORD_CNT; i++)
+		internKeyword(ctx, keywordText[i]);
+	if (ctx->costFile)
+		fprintf(ctx->costFile, "cmdSet page cmdId addr    min   max  note     "
+							   "input\n");
+	if (ctx->mapFile)
+		fprintf(ctx->mapFile,
+				"; addr grp label line input\n; geometry %d:%d:%d:%d\n",
+				ctx->geo.cmdSetBits, ctx->geo.pageBits, ctx->geo.cmdBits,
+				ctx->geo.stepBits);
+	if (cache) {
+		ctx->grpCache.path = cache;
+		loadGroupCache(ctx);
+	}
+	return true;
+}
+
+mcasm_ctx *mcasm_new(const struct mcasm_options *opts) {
+	static const struct mcasm_options defaults;
+	struct mcasm_ctx *ctx = calloc(1, sizeof(struct mcasm_ctx));
+	if (ctx == NULL)
+		return NULL;
+	if (opts == NULL)
+		opts = &defaults;
+	ctx->diag = opts->diagnostics ? opts->diagnostics : stderr;
+	ctx->symbols.name = "symbol";
+	ctx->ports.name = "port";
+	ctx->line = ctx->col = 1;
+	ctx->exitStatus = EXIT_SUCCESS;
+	ctx->geo = opts->geometry;
+	ctx->optimize = opts->optimize;
+	ctx->shareTails = opts->shareTails;
+	ctx->jobs = opts->jobs > 0 ? opts->jobs : 1;
+	ctx->snapshotDir = opts->snapshots;
+	ctx->listFile = opts->listing;
+	ctx->costFile = opts->costs;
+	ctx->mapFile = opts->map;
+	ctx->outFormat = opts->format;
+	ctx->lanes = opts->lanes;
+	ctx->patchBase = opts->patch;
+	ctx->stats = opts->stats;
+	ctx->profile = opts->profile;
+	ctx->phase = PH_PARSE;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+	ctx->phaseStart = ctx->start;
+	if (!startContext(ctx, opts->cache)) {
+		mcasm_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void mcasm_free(mcasm_ctx *ctx) {
+	if (ctx == NULL)
+		return;
+	closeSource(ctx);
+	freeSymTable(&ctx->symbols);
+	freeSymTable(&ctx->ports);
+	while (ctx->interned.blocks) {
+		struct strBlock *prev = ctx->interned.blocks->prev;
+		free(ctx->interned.blocks);
+		ctx->interned.blocks = prev;
+	}
+	free(ctx->interned.slots);
+	free(ctx->image);
+	free(ctx->grpOwner);
+	free(ctx->grps);
+	free(ctx->inputs);
+	free(ctx->tests);
+	lspFree(ctx);
+	free(ctx->grpCache.slots);
+	free(ctx);
+}
+
+bool mcasm_add_file(mcasm_ctx *ctx, const char *name, bool trace) {
+	CATCH_FATAL(false);
+	addInput(ctx, name, NULL, 0, trace);
+	return true;
+}
+
+bool mcasm_add_source(mcasm_ctx *ctx, const char *name, const char *text,
+					  size_t len, bool trace) {
+	CATCH_FATAL(false);
+	addInput(ctx, name, text, len, trace);
+	return true;
+}
+
+bool mcasm_assemble(mcasm_ctx *ctx) {
+	CATCH_FATAL(false);
+	assembleInputs(ctx, 0);
+	return ctx->exitStatus == EXIT_SUCCESS;
+}
+
+const uint16_t *mcasm_image(const mcasm_ctx *ctx) {
+	return ctx->image;
+}
+
+size_t mcasm_image_size(const mcasm_ctx *ctx) {
+	return ctx->storeSize;
+}
+
+bool mcasm_encode(mcasm_ctx *ctx, enum mcasm_lane lane, char **buf,
+				  size_t *len) {
+	FILE *f;
+	CATCH_FATAL(false);
+	if ((f = open_memstream(buf, len)) == NULL)
+		print(ctx, FATAL, "Out of memory encoding the image\n");
+	encodeLane(ctx, f, lane);
+	fclose(f);
+	return true;
+}
+
+bool mcasm_write(mcasm_ctx *ctx, const char *name) {
+	CATCH_FATAL(false);
+	ctx->outputName = name;
+	finishOutputFile(ctx, 0);
+	return ctx->exitStatus == EXIT_SUCCESS;
+}
+
+bool mcasm_write_variants(mcasm_ctx *ctx, const char *name,
+						  const struct mcasm_variant *variants, int cnt) {
+	CATCH_FATAL(false);
+	ctx->outputName = name;
+	writeVariants(ctx, variants, cnt);
+	return ctx->exitStatus == EXIT_SUCCESS;
+}
+
+bool mcasm_watch(mcasm_ctx *ctx, const char *name) {
+	CATCH_FATAL(false);
+	if (ctx->inputCnt == 0)
+		print(ctx, FATAL, "No inputs to watch\n");
+	ctx->outputName = name;
+	watchInputs(ctx);
+	return false;
+}
+
+bool mcasm_lsp(mcasm_ctx *ctx, FILE *in, FILE *out) {
+	CATCH_FATAL(false);
+	return serveLsp(ctx, in, out);
+}
+
+void mcasm_error(mcasm_ctx *ctx, const char *msg, ...) {
+	va_list args;
+	print(ctx, ERROR, "");
+	va_start(args, msg);
+	vfprintf(ctx->diag, msg, args);
+	va_end(args);
+}
+
+int mcasm_finish(mcasm_ctx *ctx) {
+	CATCH_FATAL(EXIT_FAILURE);
+	if (ctx->grpCache.path)
+		saveGroupCache(ctx);
+	if (ctx->stats)
+		printStats(ctx);
+	if (ctx->profile)
+		printProfile(ctx);
+	return ctx->exitStatus;
+}
@@ -0,0 +1,118 @@
+#ifndef MCASM_H
+#define MCASM_H
+
+/* libmcasm, the microcode assembler as a library.
+ *
+ * All the state of an assembly belongs to an mcasm_ctx, so a process can
+ * assemble several images at once, each context on its own thread. A context
+ * is not itself thread safe. Inputs are files or buffers in memory and the
+ * image can be read back, or encoded into a buffer, instead of being written
+ * to a file.
+ *
+ *     mcasm_ctx *ctx = mcasm_new(NULL);
+ *     mcasm_add_source(ctx, "ports", text, len, false);
+ *     if (mcasm_assemble(ctx))
+ *         use(mcasm_image(ctx));
+ *     mcasm_free(ctx);
+ *
+ * Diagnostics go to the options' diagnostics stream, stderr by default. After a
+ * fatal error, such as an unreadable input, every call fails and the context
+ * can only be freed.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct mcasm_ctx mcasm_ctx;
+
+enum mcasm_format { MCASM_BIN, MCASM_IHEX, MCASM_SREC };
+enum mcasm_profile {
+	MCASM_PROFILE_OFF,
+	MCASM_PROFILE_TABLE,
+	MCASM_PROFILE_JSON
+};
+// the bytes of the image to encode
+enum mcasm_lane { MCASM_BOTH, MCASM_LOW, MCASM_HIGH };
+
+/* The bits of a microcode address that select the command set, page, command
+ * group and step, from the top. All zero for the layout in microcode.h.
+ */
+struct mcasm_geometry {
+	int cmdSetBits, pageBits, cmdBits, stepBits;
+};
+
+struct mcasm_options {
+	FILE *diagnostics;				// NULL for stderr
+	struct mcasm_geometry geometry;	// of the microcode store
+	bool optimize;					// run the peephole optimizer, -O
+	bool shareTails;				// share the tails of groups, --share-tails
+	int jobs;						// inputs parsed at once in forked workers, -j
+	const char *cache;				// the group cache file, NULL for none
+	const char *snapshots;			// the snapshot directory, NULL for none
+	FILE *listing;					// where to list the groups, NULL for none
+	FILE *costs;					// where to write the step counts, NULL for none
+	FILE *map;						// where to write the source map, NULL for none
+	enum mcasm_format format;		// of the files written
+	bool lanes;						// write the low and high bytes separately
+	const char *patch;				// image to write a patch from, NULL for none
+	bool stats;						// print statistics from mcasm_finish
+	enum mcasm_profile profile;		// print a profile from mcasm_finish
+};
+
+// Returns a new context, or NULL if out of memory. opts may be NULL.
+mcasm_ctx *mcasm_new(const struct mcasm_options *opts);
+void mcasm_free(mcasm_ctx *ctx);
+
+/* Add an input to be assembled, traced if trace is set. The name, and the text
+ * of an input in memory, must stay valid until the context is freed.
+ */
+bool mcasm_add_file(mcasm_ctx *ctx, const char *name, bool trace);
+bool mcasm_add_source(mcasm_ctx *ctx, const char *name, const char *text,
+					  size_t len, bool trace);
+
+// Assemble the inputs added so far into the image. false if there are errors.
+bool mcasm_assemble(mcasm_ctx *ctx);
+// The image, mcasm_image_size commands
+const uint16_t *mcasm_image(const mcasm_ctx *ctx);
+size_t mcasm_image_size(const mcasm_ctx *ctx);
+// Encode the image in the options' format into a malloced buffer
+bool mcasm_encode(mcasm_ctx *ctx, enum mcasm_lane lane, char **buf,
+				  size_t *len);
+/* Assemble the inputs added so far, write the image to name, or to name.lo
+ * and name.hi with lanes, and start a new, empty image
+ */
+bool mcasm_write(mcasm_ctx *ctx, const char *name);
+/* A variant of an image, assembled with symbols defined as "NAME=value". The
+ * values override those of their definitions in the inputs.
+ */
+struct mcasm_variant {
+	const char *output; // where it is written
+	const char *const *defines;
+	int defineCnt;
+};
+/* As mcasm_write, and write each of cnt variants of the image to its output.
+ * The inputs before the first that names a symbol a variant defines are
+ * assembled once, and the variants are assembled from there in forked
+ * processes, jobs at a time.
+ */
+bool mcasm_write_variants(mcasm_ctx *ctx, const char *name,
+						  const struct mcasm_variant *variants, int cnt);
+// Write the image to name, then assemble it again whenever its inputs change
+bool mcasm_watch(mcasm_ctx *ctx, const char *name);
+/* Serve the Language Server Protocol on in and out until the client exits. The
+ * inputs added so far are assembled first, in their order, followed by the
+ * documents the client opens that are not among them; an input the client
+ * opens is assembled from the client's text. Returns true if the client shut
+ * the server down before it exited.
+ */
+bool mcasm_lsp(mcasm_ctx *ctx, FILE *in, FILE *out);
+// Report an error that fails the assembly
+void mcasm_error(mcasm_ctx *ctx, const char *msg, ...);
+
+/* Save the group cache and print the statistics and profile asked for.
+ * Returns the exit status of the assembly.
+ */
+int mcasm_finish(mcasm_ctx *ctx);
+
+#endif
@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "microcode.h"
+
+/* Generates synthetic microcode source, to measure mcasm.
+
+   The output defines the requested number of ports and symbols, then fills
+   every command group of the requested command sets, on both pages, with
+   commands that read and write random ports, load symbols as immediates and
+   branch to labels in the group.
+*/
+
+unsigned long seed = 1;
+
+// A small LCG, so the output only depends on the options
+int rnd(int n) {
+	seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+	return (int)((seed >> 33) % (unsigned long)n);
+}
+
+void printHelp(const char *progName) {
+	fprintf(stderr,
+			"Usage: %s [-p ports] [-d defs] [-c cmdSets] [-g groups] "
+			"[-s seed] [-o file]\n",
+			progName);
+}
+
+int main(int argc, char const *argv[]) {
+	int ports = 2000, defs = 4000, cmdSets = 1 << CMDSET_BITS;
+	int groups = 1 << CMD_BITS;
+	const char *outName = NULL;
+	FILE *out = stdout;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			ports = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			defs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			cmdSets = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+			groups = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outName = argv[++i];
+		else {
+			printHelp(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (ports < 1 || defs < 1 || cmdSets < 1 || cmdSets > 1 << CMDSET_BITS ||
+		groups < 1 || groups > 1 << CMD_BITS) {
+		fprintf(stderr, "%s: options out of range\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (outName && (out = fopen(outName, "w")) == NULL) {
+		fprintf(stderr, "%s: can't write %s\n", argv[0], outName);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "; generated by mcgen -p %d -d %d -c %d -g %d\nforget\n",
+			ports, defs, cmdSets, groups);
+	for (int i = 0; i < ports; i++)
+		fprintf(out, "port p%d 0b%d%d%d%d_%d%d%d\n", i, rnd(2), rnd(2), rnd(2),
+				rnd(2), rnd(2), rnd(2), rnd(2));
+	for (int i = 0; i < defs; i++)
+		fprintf(out, "def d%d %d\n", i, rnd(256));
+	for (int i = 0; i < groups; i++)
+		fprintf(out, "def g%d %d\n", i, i);
+
+	for (int set = 0; set < cmdSets; set++)
+		for (int pg = 0; pg < 1 << PAGE_BITS; pg++) {
+			fprintf(out, "\ncmdSet %d\npage %d\n", set, pg);
+			for (int g = 0; g < groups; g++) {
+				fprintf(out, "grp g%d {\n", g);
+				for (int step = 0; step < CMDS_PER_GRP; step++) {
+					int dst = rnd(ports);
+					fprintf(out, "  l%d : p%d", step, dst);
+					switch (rnd(4)) {
+					case 0:
+						fprintf(out, " =# d%d", rnd(defs));
+						break;
+					case 1:
+						fprintf(out, " = p%d p%d", rnd(ports), rnd(ports));
+						break;
+					case 2:
+						fprintf(out, " =? p%d ; test", rnd(ports));
+						break;
+					default:
+						fprintf(out, " =: l%d", rnd(CMDS_PER_GRP));
+						break;
+					}
+					fputc('\n', out);
+				}
+				fprintf(out, "}\n");
+			}
+		}
+	if (fclose(out) != 0) {
+		fprintf(stderr, "%s: can't write %s\n", argv[0],
+				outName ? outName : "output");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
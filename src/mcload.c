@@ -0,0 +1,308 @@
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcpatch.h"
+
+/* A stand-in for the loader of a running machine, which updates its microcode
+   store from a patch, written by mcasm --patch, sent over a serial link.
+
+   mcload opens a pseudo terminal and forks. The child is the loader: it holds
+   the store, read from the image file, and reads the patch from the terminal.
+   It refuses a patch for another store, or whose base isn't the store, and
+   applies the runs to a copy of the store. Only if the CRCs of the patch and of
+   the patched store are right does it write the store back to the image file
+   and reply "ok", with the commands written and the time it was busy, not
+   waiting for the link. Otherwise it replies with the error and the image is
+   left alone.
+
+   The parent sends the patch at the rate of a serial link of -b baud, 10 bits
+   a byte, or as fast as the terminal takes it with -b 0, and reports the size
+   of the patch, the time to send it and the loader's reply.
+*/
+
+#define CHUNK 16 // bytes sent at a time
+
+double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void waitUntil(double when) {
+	double wait = when - now();
+	struct timespec t;
+	if (wait <= 0)
+		return;
+	t.tv_sec = wait;
+	t.tv_nsec = (wait - t.tv_sec) * 1e9;
+	nanosleep(&t, NULL);
+}
+
+void fatal(const char *msg, const char *arg) {
+	fprintf(stderr, "mcload: ");
+	fprintf(stderr, msg, arg);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+// Read a whole file into a malloced buffer
+uint8_t *readFile(const char *name, size_t *len) {
+	int fd = open(name, O_RDONLY);
+	struct stat st;
+	uint8_t *buf;
+	ssize_t n = 0;
+	if (fd < 0 || fstat(fd, &st) != 0)
+		fatal("Can't read %s", name);
+	*len = st.st_size;
+	if ((buf = malloc(*len ? *len : 1)) == NULL)
+		fatal("Out of memory reading %s", name);
+	for (size_t pos = 0; pos < *len; pos += n)
+		if ((n = read(fd, buf + pos, *len - pos)) <= 0)
+			fatal("Can't read %s", name);
+	close(fd);
+	return buf;
+}
+
+/* The loader */
+
+int term;						// its end of the terminal
+double busy;					// time not waiting for the link
+double busyFrom;				// when it stopped waiting
+uint16_t crc = PATCH_CRC_START; // of the patch read so far
+
+// Read len bytes of the patch, adding them to its CRC
+bool receive(uint8_t *p, size_t len) {
+	busy += now() - busyFrom;
+	for (size_t pos = 0; pos < len;) {
+		ssize_t n = read(term, p + pos, len - pos);
+		if (n <= 0)
+			return false;
+		pos += n;
+	}
+	busyFrom = now();
+	crc = crc16(crc, p, len);
+	return true;
+}
+
+void reply(const char *msg, const char *arg) {
+	char line[256];
+	int len = snprintf(line, sizeof(line), msg, arg);
+	if (write(term, line, len) != len)
+		exit(EXIT_FAILURE);
+}
+
+// Write len bytes to the file name, replacing it only once they are written
+bool writeFile(const char *name, const uint8_t *p, size_t len) {
+	char *tmpName = malloc(strlen(name) + sizeof(".load"));
+	int fd;
+	bool ok;
+	sprintf(tmpName, "%s.load", name);
+	fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	ok = fd >= 0 && write(fd, p, len) == (ssize_t)len;
+	ok = fd >= 0 && close(fd) == 0 && ok && rename(tmpName, name) == 0;
+	if (!ok)
+		unlink(tmpName);
+	free(tmpName);
+	return ok;
+}
+
+// Apply the patch read from term to the image file, returning the exit status
+int load(const char *imageName) {
+	uint8_t header[PATCH_HEADER_LEN], run[PATCH_RUN_LEN], crcBytes[2];
+	uint8_t *store, *next;
+	size_t len;
+	uint16_t patchCrc;
+	int written = 0;
+	char line[64];
+	store = readFile(imageName, &len);
+	if ((next = malloc(len ? len : 1)) == NULL)
+		fatal("Out of memory loading %s", imageName);
+	memcpy(next, store, len);
+	busyFrom = now();
+	if (!receive(header, sizeof(header)))
+		return reply("error: the patch ended early\n", NULL), EXIT_FAILURE;
+	if (memcmp(header, PATCH_MAGIC, 4) != 0)
+		return reply("error: not a patch\n", NULL), EXIT_FAILURE;
+	if (header[4] >= 8 * sizeof(size_t) - 1 || len != (size_t)2 << header[4])
+		return reply("error: the patch is for another store\n", NULL),
+			   EXIT_FAILURE;
+	if (crc16(PATCH_CRC_START, store, len) != (header[5] << 8 | header[6]))
+		return reply("error: the store isn't the base of the patch\n", NULL),
+			   EXIT_FAILURE;
+	for (;;) {
+		size_t addr;
+		if (!receive(run, sizeof(run)))
+			return reply("error: the patch ended early\n", NULL), EXIT_FAILURE;
+		addr = (size_t)run[0] << 16 | run[1] << 8 | run[2];
+		if (run[3] == 0)
+			break;
+		if (2 * (addr + run[3]) > len)
+			return reply("error: a run is outside the store\n", NULL),
+				   EXIT_FAILURE;
+		if (!receive(next + 2 * addr, 2 * run[3]))
+			return reply("error: the patch ended early\n", NULL), EXIT_FAILURE;
+		written += run[3];
+	}
+	patchCrc = crc;
+	if (!receive(crcBytes, sizeof(crcBytes)))
+		return reply("error: the patch ended early\n", NULL), EXIT_FAILURE;
+	if (patchCrc != (crcBytes[0] << 8 | crcBytes[1]))
+		return reply("error: bad CRC, the patch was corrupted\n", NULL),
+			   EXIT_FAILURE;
+	if (crc16(PATCH_CRC_START, next, len) != (header[7] << 8 | header[8]))
+		return reply("error: the patched store has the wrong CRC\n", NULL),
+			   EXIT_FAILURE;
+	if (!writeFile(imageName, next, len))
+		return reply("error: can't write the store\n", NULL), EXIT_FAILURE;
+	busy += now() - busyFrom;
+	snprintf(line, sizeof(line), "ok %d %.6f\n", written, busy);
+	reply("%s", line);
+	return EXIT_SUCCESS;
+}
+
+/* The sender */
+
+// Count the runs and commands of a patch, checking it is well formed
+void countRuns(const char *name, const uint8_t *p, size_t len, int *runs,
+			   int *cmds) {
+	size_t pos = PATCH_HEADER_LEN;
+	*runs = *cmds = 0;
+	if (len < PATCH_HEADER_LEN || memcmp(p, PATCH_MAGIC, 4) != 0)
+		fatal("%s is not a patch", name);
+	for (;;) {
+		if (pos + PATCH_RUN_LEN > len)
+			fatal("%s is truncated", name);
+		if (p[pos + 3] == 0)
+			break;
+		(*runs)++;
+		*cmds += p[pos + 3];
+		pos += PATCH_RUN_LEN + 2 * p[pos + 3];
+	}
+	if (pos + PATCH_RUN_LEN + 2 != len)
+		fatal("%s is truncated or has trailing bytes", name);
+}
+
+// Send the patch over the master side of the terminal at baud, 0 for no limit
+double sendPatch(int master, const uint8_t *p, size_t len, long baud) {
+	double start = now();
+	for (size_t pos = 0; pos < len;) {
+		size_t n = len - pos < CHUNK ? len - pos : CHUNK;
+		ssize_t sent;
+		// wait until the link would have sent the bytes before
+		if (baud > 0)
+			waitUntil(start + pos * 10.0 / baud);
+		if ((sent = write(master, p + pos, n)) <= 0)
+			break; // the loader gave up, its reply says why
+		pos += sent;
+	}
+	// the last bytes take their time on the link too
+	if (baud > 0)
+		waitUntil(start + len * 10.0 / baud);
+	return now() - start;
+}
+
+// Make the terminal pass bytes through unchanged
+void makeRaw(int fd) {
+	struct termios t;
+	if (tcgetattr(fd, &t) != 0)
+		fatal("Can't set up the terminal%s", "");
+	t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL |
+				   IXON | IXOFF);
+	t.c_oflag &= ~OPOST;
+	t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	t.c_cflag &= ~(CSIZE | PARENB);
+	t.c_cflag |= CS8;
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSANOW, &t) != 0)
+		fatal("Can't set up the terminal%s", "");
+}
+
+void printHelp(const char *progName) {
+	fprintf(stderr, "Usage: %s [-b baud] image patch\n", progName);
+}
+
+int main(int argc, char const *argv[]) {
+	const char *imageName = NULL, *patchName = NULL;
+	long baud = 115200;
+	uint8_t *patch;
+	size_t len;
+	int master, runs, cmds, status;
+	char answer[256];
+	size_t answerLen = 0;
+	double sendTime, start;
+	pid_t pid;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			baud = atol(argv[++i]);
+		else if (*argv[i] != '-' && imageName == NULL)
+			imageName = argv[i];
+		else if (*argv[i] != '-' && patchName == NULL)
+			patchName = argv[i];
+		else {
+			printHelp(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (imageName == NULL || patchName == NULL || baud < 0) {
+		printHelp(argv[0]);
+		return EXIT_FAILURE;
+	}
+	patch = readFile(patchName, &len);
+	countRuns(patchName, patch, len, &runs, &cmds);
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+		grantpt(master) != 0 || unlockpt(master) != 0 ||
+		(term = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0)
+		fatal("Can't open a pseudo terminal%s", "");
+	makeRaw(term);
+	if ((pid = fork()) < 0)
+		fatal("Can't start the loader%s", "");
+	if (pid == 0) {
+		close(master);
+		exit(load(imageName));
+	}
+	close(term);
+
+	start = now();
+	sendTime = sendPatch(master, patch, len, baud);
+	// the reply is a line
+	while (answerLen < sizeof(answer) - 1) {
+		ssize_t n = read(master, answer + answerLen, 1);
+		if (n <= 0 || answer[answerLen] == '\n')
+			break;
+		answerLen++;
+	}
+	answer[answerLen] = '\0';
+	waitpid(pid, &status, 0);
+	printf("%s: %zu bytes, %d runs of %d commands\n", patchName, len, runs,
+		   cmds);
+	if (baud > 0)
+		printf("sent in %.3f s at %ld baud, the whole image would take "
+			   "%.3f s\n",
+			   sendTime, baud, 2.0 * (1 << patch[4]) * 10 / baud);
+	else
+		printf("sent in %.6f s\n", sendTime);
+	if (strncmp(answer, "ok ", 3) == 0) {
+		int written;
+		double busy;
+		sscanf(answer, "ok %d %lf", &written, &busy);
+		printf("%s: %d commands written, loader busy for %.6f s, "
+			   "acknowledged after %.3f s\n",
+			   imageName, written, busy, now() - start);
+		return EXIT_SUCCESS;
+	}
+	fflush(stdout);
+	fprintf(stderr, "mcload: %s\n", answerLen ? answer : "no reply");
+	return EXIT_FAILURE;
+}
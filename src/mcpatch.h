@@ -0,0 +1,48 @@
+#ifndef MCPATCH_H
+#define MCPATCH_H
+
+/* The format of a microcode patch, written by mcasm --patch and applied by
+ * mcload. A patch holds the commands of an image that differ from those of a
+ * base image, so a running machine can be updated without sending the whole
+ * store over a serial link.
+ *
+ *   header  "MCP1", the address bits of the store, the CRC of the base image
+ *           and the CRC of the patched image
+ *   run     the address of its first command in 3 bytes, the number of
+ *           commands, 1 to 255, and the commands, low byte first
+ *   end     a run of no commands at address 0, then the CRC of the bytes of
+ *           the patch before it
+ *
+ * Numbers of more than one byte are big endian, except commands. CRCs are
+ * CRC-16/CCITT, those of images over their bytes, two per command low first.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATCH_MAGIC "MCP1"
+#define PATCH_HEADER_LEN 9
+#define PATCH_RUN_LEN 4 // bytes of a run before its commands
+#define PATCH_MAX_RUN 255
+#define PATCH_CRC_START 0xffff
+
+// CRC-16/CCITT of len bytes at p, continuing from crc
+static inline uint16_t crc16(uint16_t crc, const uint8_t *p, size_t len) {
+	while (len--) {
+		crc ^= *p++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+// CRC-16/CCITT of the bytes of n commands at cv, continuing from crc
+static inline uint16_t crc16Commands(uint16_t crc, const uint16_t *cv,
+									 size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint8_t b[2] = {cv[i] & 0xff, cv[i] >> 8};
+		crc = crc16(crc, b, 2);
+	}
+	return crc;
+}
+
+#endif
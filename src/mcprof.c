@@ -0,0 +1,643 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "microcode.h"
+
+/* Profiles microcode from a capture of the microcode address bus, made by a
+   logic analyzer on real hardware and exported as CSV or VCD.
+
+   Each address is split into its cmdSet, page, cmdId and step, by the geometry
+   in the source map written by mcasm --map, and named from the map. The report
+   gives the executions and the share of the captured time of each command
+   group and of each step, the most expensive first.
+
+   The capture is streamed through a fixed buffer, so it can be larger than
+   memory. Without a clock, each change of the address starts an execution of
+   the new step, which lasts until the next change. With -k, each rising edge
+   of the clock executes the step whose address was on the bus before it, and
+   it lasts until the next rising edge. An address with unknown bits, x or z,
+   executes nothing.
+
+   The bus is a vector signal or column named by -s, or single bit signals or
+   columns named <bus>0, <bus>1, ... or <bus>[0], <bus>[1], ... CSV files have
+   a header row naming the columns and a time in seconds in the first column.
+   Values are decimal, 0x hex or 0b binary.
+*/
+
+#define MAX_ADDR_BITS 32
+#define MAX_FIELDS 256
+#define NO_ADDR -1 // unknown bits on the bus
+
+// the source of a step, from the map, and what it cost
+struct step {
+	const char *grp; // NULL if not in the map
+	const char *label;
+	const char *input;
+	int line;
+	uint64_t count;
+	double secs;
+} *steps;
+
+struct grpCost {
+	int grp;
+	uint64_t count; // times it was entered from another group
+	double secs;
+};
+uint64_t *entries; // of each group
+
+// the layout of addresses, from the map
+int cmdSetBits = CMDSET_BITS, pageBits = PAGE_BITS, cmdBits = CMD_BITS,
+	stepBits = STEP_BITS;
+int addrBits, storeSize, grpSize, grpCnt;
+
+/* The capture, read a buffer at a time. A line, or a VCD token, is never
+   split by a refill.
+*/
+int fd;
+char buf[1 << 20];
+size_t bufLen, bufPos;
+const char *captureName;
+long lineNo;
+
+// the address bus and clock, as the capture is read
+int bits[MAX_ADDR_BITS];		// value of each bit signal, -1 if unknown
+int busFields[MAX_ADDR_BITS]; // CSV column of each bit, or -1
+int busField = -1;			// CSV column of the bus vector, or -1
+int clockField = -1;		// CSV column of the clock, or -1
+bool useClock;				// an execution per rising edge of the clock
+int clockValue = 0;			// last value of the clock
+long cur = NO_ADDR;			// the address on the bus
+long settled = NO_ADDR;		// the address at the previous time
+double now = 0;				// time of the changes being read
+bool started;				// a time has been read
+long visitAddr = NO_ADDR;	// the step executing
+double visitStart;			// when it started
+uint64_t executions;		// of steps in the map or not
+uint64_t unmapped;			// executions of steps not in the map
+double firstTime, lastTime; // of the capture
+
+void fatal(const char *msg, const char *arg) {
+	fprintf(stderr, "mcprof: ");
+	fprintf(stderr, msg, arg);
+	if (lineNo)
+		fprintf(stderr, " at line %ld of %s", lineNo, captureName);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+// Move the unread input to the start of buf and read more after it
+bool fill() {
+	ssize_t n;
+	memmove(buf, buf + bufPos, bufLen - bufPos);
+	bufLen -= bufPos;
+	bufPos = 0;
+	n = read(fd, buf + bufLen, sizeof(buf) - 1 - bufLen);
+	if (n < 0)
+		fatal("Can't read %s", captureName);
+	bufLen += n;
+	return n > 0;
+}
+
+// Returns the next line, without its line end, or NULL at the end of input
+char *nextLine() {
+	char *line, *nl;
+	while ((nl = memchr(buf + bufPos, '\n', bufLen - bufPos)) == NULL) {
+		if (bufPos == 0 && bufLen == sizeof(buf) - 1)
+			fatal("Line too long in %s", captureName);
+		if (!fill()) {
+			if (bufPos == bufLen)
+				return NULL;
+			nl = buf + bufLen; // a last line without a line end
+			break;
+		}
+	}
+	line = buf + bufPos;
+	bufPos = nl - buf + (nl < buf + bufLen);
+	*nl = '\0';
+	if (nl > line && nl[-1] == '\r')
+		nl[-1] = '\0';
+	lineNo++;
+	return line;
+}
+
+// Parse a decimal, 0x hex or 0b binary value, returning NO_ADDR if it isn't one
+long parseValue(const char *s) {
+	char *end;
+	long v;
+	while (*s == ' ' || *s == '"')
+		s++;
+	if (s[0] == '0' && (s[1] == 'b' || s[1] == 'B'))
+		v = strtol(s + 2, &end, 2);
+	else
+		v = strtol(s, &end, 0);
+	if (end == s)
+		return NO_ADDR;
+	return v;
+}
+
+// Copy the next whitespace separated word of *s, returning false if none
+bool nextWord(char **s, char *word, size_t size) {
+	size_t len;
+	*s += strspn(*s, " \t");
+	if (**s == '\0')
+		return false;
+	len = strcspn(*s, " \t");
+	if (len >= size)
+		len = size - 1;
+	memcpy(word, *s, len);
+	word[len] = '\0';
+	*s += strcspn(*s, " \t");
+	return true;
+}
+
+// Size the profile for the geometry
+void setGeometry(const char *mapName) {
+	addrBits = cmdSetBits + pageBits + cmdBits + stepBits;
+	if (cmdSetBits < 0 || pageBits < 0 || cmdBits < 0 || stepBits < 0 ||
+		addrBits > 24)
+		fatal("Invalid geometry in the source map %s", mapName);
+	storeSize = 1 << addrBits;
+	grpSize = 1 << stepBits;
+	grpCnt = storeSize / grpSize;
+	steps = calloc(storeSize, sizeof(struct step));
+	entries = calloc(grpCnt, sizeof(uint64_t));
+	if (steps == NULL || entries == NULL)
+		fatal("Out of memory for the source map %s", mapName);
+}
+
+void loadMap(const char *mapName) {
+	FILE *f = fopen(mapName, "r");
+	char line[1024], grp[256], label[256], input[768];
+	const char *lastGrp = "", *lastInput = "";
+	unsigned addr;
+	int srcLine;
+	if (f == NULL)
+		fatal("Can't read the source map %s", mapName);
+	while (fgets(line, sizeof(line), f)) {
+		struct step *s;
+		if (steps == NULL &&
+			sscanf(line, "; geometry %d:%d:%d:%d", &cmdSetBits, &pageBits,
+				   &cmdBits, &stepBits) == 4)
+			continue;
+		if (line[0] == ';' || line[0] == '\n')
+			continue;
+		if (steps == NULL)
+			setGeometry(mapName);
+		if (sscanf(line, "%x %255s %255s %d %767[^\n]", &addr, grp, label,
+				   &srcLine, input) != 5 ||
+			addr >= (unsigned)storeSize) {
+			fprintf(stderr, "mcprof: ignoring %s in %s", line, mapName);
+			continue;
+		}
+		s = &steps[addr];
+		// steps of a group share their strings
+		s->grp = lastGrp = strcmp(grp, lastGrp) == 0 ? lastGrp : strdup(grp);
+		s->input = lastInput =
+			strcmp(input, lastInput) == 0 ? lastInput : strdup(input);
+		s->label = strcmp(label, "-") == 0 ? NULL : strdup(label);
+		s->line = srcLine;
+	}
+	fclose(f);
+	if (steps == NULL)
+		setGeometry(mapName);
+}
+
+// End the execution of the current step at t, then start one of addr
+void execute(long addr, double t) {
+	if (visitAddr != NO_ADDR)
+		steps[visitAddr].secs += t - visitStart;
+	addr = addr == NO_ADDR ? NO_ADDR : addr & (storeSize - 1);
+	if (addr != NO_ADDR && (visitAddr == NO_ADDR ||
+							addr / grpSize != visitAddr / grpSize))
+		entries[addr / grpSize]++;
+	visitAddr = addr;
+	visitStart = t;
+	if (visitAddr == NO_ADDR)
+		return;
+	steps[visitAddr].count++;
+	executions++;
+	unmapped += steps[visitAddr].grp == NULL;
+}
+
+// All the changes at the current time have been read, and time moves to t
+void advance(double t) {
+	if (!started)
+		firstTime = t, started = true;
+	if (!useClock && cur != visitAddr)
+		execute(cur, now);
+	settled = cur;
+	now = lastTime = t;
+}
+
+void setClock(int v) {
+	if (v == 1 && clockValue == 0)
+		execute(settled, now);
+	clockValue = v;
+}
+
+// The address from the bit signals
+long bitsAddr() {
+	long v = 0;
+	for (int i = 0; i < addrBits; i++) {
+		if (bits[i] < 0)
+			return NO_ADDR;
+		v |= (long)bits[i] << i;
+	}
+	return v;
+}
+
+// Returns i if name is the bit bus[i], or -1
+int busBit(const char *name, const char *bus) {
+	size_t len = strlen(bus);
+	char *end;
+	long i;
+	if (strncmp(name, bus, len) != 0)
+		return -1;
+	name += len;
+	i = strtol(name + (*name == '['), &end, 10);
+	if (end == name + (*name == '[') || (*name == '[' && *end++ != ']') ||
+		*end != '\0' || i < 0 || i >= addrBits)
+		return -1;
+	return i;
+}
+
+/* CSV */
+
+// Split line at commas into at most MAX_FIELDS fields, returning the count
+int splitFields(char *line, char **fields) {
+	int n = 0;
+	fields[n++] = line;
+	for (char *p = line; (p = strchr(p, ',')) != NULL && n < MAX_FIELDS;) {
+		*p++ = '\0';
+		fields[n++] = p;
+	}
+	return n;
+}
+
+// Strip spaces and quotes around a header field
+char *fieldName(char *s) {
+	char *end;
+	while (*s == ' ' || *s == '"')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '"'))
+		*--end = '\0';
+	return s;
+}
+
+void readCsv(const char *bus, const char *clock) {
+	char *fields[MAX_FIELDS], *line = nextLine();
+	int n, bitCnt = 0;
+	if (line == NULL)
+		fatal("%s is empty", captureName);
+	n = splitFields(line, fields);
+	for (int i = 0; i < addrBits; i++)
+		busFields[i] = -1;
+	for (int i = 1; i < n; i++) {
+		char *name = fieldName(fields[i]);
+		int bit = busBit(name, bus);
+		if (strcmp(name, bus) == 0)
+			busField = i;
+		else if (clock && strcmp(name, clock) == 0)
+			clockField = i;
+		else if (bit >= 0 && busFields[bit] < 0)
+			busFields[bit] = i, bitCnt++;
+	}
+	if (busField < 0 && bitCnt < addrBits)
+		fatal("No column for the bus %s", bus);
+	if (clock && clockField < 0)
+		fatal("No column for the clock %s", clock);
+	while ((line = nextLine()) != NULL) {
+		if (*line == '\0')
+			continue;
+		if (splitFields(line, fields) < n)
+			fatal("Too few columns%s", "");
+		advance(strtod(fields[0], NULL));
+		if (busField >= 0)
+			cur = parseValue(fields[busField]);
+		else {
+			for (int i = 0; i < addrBits; i++)
+				bits[i] = parseValue(fields[busFields[i]]);
+			cur = bitsAddr();
+		}
+		if (clockField >= 0)
+			setClock(parseValue(fields[clockField]) == 1);
+	}
+}
+
+/* VCD */
+
+#define VCD_IDS 4096 // slots for the identifiers of the signals used
+#define VCD_ID_SIZE 16
+#define VCD_BUS -1
+#define VCD_CLOCK -2
+
+// the signals used, by identifier code
+struct vcdSignal {
+	char id[VCD_ID_SIZE]; // "" if the slot is empty
+	int use; // VCD_BUS, VCD_CLOCK or a bit of the bus
+} vcdSignals[VCD_IDS];
+
+unsigned hashId(const char *id, size_t len) {
+	unsigned h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)id[i]) * 16777619u;
+	return h & (VCD_IDS - 1);
+}
+
+// Returns the signal with the identifier code id of len characters, or NULL
+struct vcdSignal *findSignal(const char *id, size_t len, bool add) {
+	struct vcdSignal *s;
+	if (len >= VCD_ID_SIZE)
+		return NULL;
+	for (unsigned h = hashId(id, len);; h = (h + 1) & (VCD_IDS - 1)) {
+		s = &vcdSignals[h];
+		if (s->id[0] == '\0') {
+			if (!add)
+				return NULL;
+			memcpy(s->id, id, len);
+			s->id[len] = '\0';
+			return s;
+		}
+		if (strncmp(s->id, id, len) == 0 && s->id[len] == '\0')
+			return s;
+	}
+}
+
+// Set a signal to the value in s, of len characters, in VCD form
+void setSignal(const struct vcdSignal *sig, const char *s, size_t len) {
+	long v = 0;
+	if (sig->use == VCD_BUS) {
+		for (size_t i = 0; i < len; i++) {
+			if (s[i] != '0' && s[i] != '1') {
+				cur = NO_ADDR;
+				return;
+			}
+			v = v << 1 | (s[i] - '0');
+		}
+		cur = v;
+	} else if (len != 1 || (*s != '0' && *s != '1')) {
+		if (sig->use == VCD_CLOCK)
+			setClock(-1);
+		else
+			bits[sig->use] = -1, cur = NO_ADDR;
+	} else if (sig->use == VCD_CLOCK)
+		setClock(*s - '0');
+	else {
+		bits[sig->use] = *s - '0';
+		cur = bitsAddr();
+	}
+}
+
+// Returns the seconds in a tick of a $timescale, such as 10 ns
+double parseTimescale(const char *s) {
+	static const char *units[] = {"s", "ms", "us", "ns", "ps", "fs"};
+	char *unit;
+	double scale = strtod(s, &unit), mul = 1;
+	while (*unit == ' ' || *unit == '\t')
+		unit++;
+	for (size_t i = 0; i < sizeof(units) / sizeof(*units); i++, mul /= 1000)
+		if (strncmp(unit, units[i], strlen(units[i])) == 0 &&
+			(unit[strlen(units[i])] == '\0' || unit[strlen(units[i])] == ' '))
+			return (scale ? scale : 1) * mul;
+	fatal("Unknown timescale, %s", s);
+	return 0;
+}
+
+// Read the declarations, up to $enddefinitions, returning the tick length
+double readVcdHeader(const char *bus, const char *clock) {
+	char *line, word[256], decl[1024] = "";
+	double tick = 1e-9; // the common default
+	int bitCnt = 0;
+	bool hasBus = false, hasClock = false;
+	while ((line = nextLine()) != NULL) {
+		char *p = line;
+		while (nextWord(&p, word, sizeof(word))) {
+			// gather each declaration, which may span lines, up to $end
+			if (strcmp(word, "$end") != 0) {
+				if (strlen(decl) + strlen(word) + 2 < sizeof(decl))
+					strcat(strcat(decl, decl[0] ? " " : ""), word);
+				continue;
+			}
+			if (strncmp(decl, "$timescale ", 11) == 0)
+				tick = parseTimescale(decl + 11);
+			else if (strncmp(decl, "$var ", 5) == 0) {
+				char type[64], id[64], name[256];
+				int width, bit;
+				if (sscanf(decl, "$var %63s %d %63s %255s", type, &width, id,
+						   name) == 4) {
+					struct vcdSignal *s;
+					bit = busBit(name, bus);
+					if (strcmp(name, bus) == 0 && width > 1) {
+						if ((s = findSignal(id, strlen(id), true)) != NULL)
+							s->use = VCD_BUS, hasBus = true;
+					} else if (clock && strcmp(name, clock) == 0) {
+						if ((s = findSignal(id, strlen(id), true)) != NULL)
+							s->use = VCD_CLOCK, hasClock = true;
+					} else if (bit >= 0 && width == 1) {
+						if ((s = findSignal(id, strlen(id), true)) != NULL)
+							s->use = bit, bitCnt++;
+					}
+				}
+			} else if (strncmp(decl, "$enddefinitions", 15) == 0) {
+				if (!hasBus && bitCnt < addrBits)
+					fatal("No signal for the bus %s", bus);
+				if (clock && !hasClock)
+					fatal("No signal for the clock %s", clock);
+				return tick;
+			}
+			decl[0] = '\0';
+		}
+	}
+	fatal("No $enddefinitions in %s", captureName);
+	return 0;
+}
+
+void readVcd(const char *bus, const char *clock) {
+	double tick = readVcdHeader(bus, clock);
+	char *line;
+	for (int i = 0; i < addrBits; i++)
+		bits[i] = -1;
+	while ((line = nextLine()) != NULL) {
+		for (char *p = line; *p;) {
+			char *word = p + strspn(p, " \t");
+			size_t len = strcspn(word, " \t");
+			struct vcdSignal *sig;
+			p = word + len;
+			if (len == 0)
+				break;
+			switch (*word) {
+			case '#':
+				advance(strtoull(word + 1, NULL, 10) * tick);
+				break;
+			case 'b':
+			case 'B': {
+				// the identifier follows as the next word
+				char *id = p + strspn(p, " \t");
+				size_t idLen = strcspn(id, " \t");
+				p = id + idLen;
+				if ((sig = findSignal(id, idLen, false)) != NULL)
+					setSignal(sig, word + 1, len - 1);
+				break;
+			}
+			case '0':
+			case '1':
+			case 'x':
+			case 'X':
+			case 'z':
+			case 'Z':
+				if ((sig = findSignal(word + 1, len - 1, false)) != NULL)
+					setSignal(sig, word, 1);
+				break;
+			case 'r':
+			case 'R': // reals are not used for the bus
+				p += strspn(p, " \t");
+				p += strcspn(p, " \t");
+				break;
+			default: // $dumpvars, $end, $comment ...
+				break;
+			}
+		}
+	}
+}
+
+/* Report */
+
+int bySecs(const void *a, const void *b) {
+	const struct grpCost *x = a, *y = b;
+	if (x->secs != y->secs)
+		return x->secs < y->secs ? 1 : -1;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+int stepBySecs(const void *a, const void *b) {
+	const struct step *x = &steps[*(const int *)a];
+	const struct step *y = &steps[*(const int *)b];
+	if (x->secs != y->secs)
+		return x->secs < y->secs ? 1 : -1;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+// the name of a group, from the map entry of any of its steps
+const struct step *grpSource(int grp) {
+	for (int i = 0; i < grpSize; i++)
+		if (steps[grp * grpSize + i].grp)
+			return &steps[grp * grpSize + i];
+	return NULL;
+}
+
+void report(int top) {
+	struct grpCost *grps = malloc(grpCnt * sizeof(struct grpCost));
+	int *order = malloc(storeSize * sizeof(int));
+	double total = lastTime - firstTime;
+	int usedCnt = 0, stepCnt = 0;
+	if (grps == NULL || order == NULL)
+		fatal("Out of memory%s", "");
+	for (int g = 0; g < grpCnt; g++) {
+		struct grpCost *c = &grps[usedCnt];
+		c->grp = g, c->count = entries[g], c->secs = 0;
+		for (int i = 0; i < grpSize; i++)
+			c->secs += steps[g * grpSize + i].secs;
+		for (int i = 0; i < grpSize; i++)
+			if (steps[g * grpSize + i].count) {
+				usedCnt++;
+				break;
+			}
+	}
+	for (int a = 0; a < storeSize; a++)
+		if (steps[a].count)
+			order[stepCnt++] = a;
+	qsort(grps, usedCnt, sizeof(*grps), bySecs);
+	qsort(order, stepCnt, sizeof(*order), stepBySecs);
+
+	printf("; %s: %" PRIu64 " executions in %.9f s, %" PRIu64
+		   " not in the map\n",
+		   captureName, executions, total, unmapped);
+	printf("\n;  share      seconds        count  addr  set:pg:cmd  grp  "
+		   "input\n");
+	for (int i = 0; i < usedCnt && (top == 0 || i < top); i++) {
+		const struct step *src = grpSource(grps[i].grp);
+		int g = grps[i].grp;
+		printf("%6.2f%% %12.9f %12" PRIu64 "  %4.4x  %d:%d:%-3d     %s  %s\n",
+			   total > 0 ? 100 * grps[i].secs / total : 0, grps[i].secs,
+			   grps[i].count, g * grpSize, g >> (pageBits + cmdBits),
+			   (g >> cmdBits) & SET_BITS(pageBits), g & SET_BITS(cmdBits),
+			   src ? src->grp : "?", src ? src->input : "?");
+	}
+	printf("\n;  share      seconds        count  addr  set:pg:cmd:step  grp  "
+		   "label  line  input\n");
+	for (int i = 0; i < stepCnt && (top == 0 || i < top); i++) {
+		const struct step *s = &steps[order[i]];
+		int a = order[i];
+		printf("%6.2f%% %12.9f %12" PRIu64 "  %4.4x  %d:%d:%d:%-2d  %s  %s  "
+			   "%d  %s\n",
+			   total > 0 ? 100 * s->secs / total : 0, s->secs, s->count, a,
+			   a >> (stepBits + cmdBits + pageBits),
+			   (a >> (stepBits + cmdBits)) & SET_BITS(pageBits),
+			   (a >> stepBits) & SET_BITS(cmdBits), a & SET_BITS(stepBits),
+			   s->grp ? s->grp : "?", s->label ? s->label : "-", s->line,
+			   s->input ? s->input : "?");
+	}
+}
+
+void printHelp(const char *progName) {
+	fprintf(stderr,
+			"Usage: %s -m map [-s bus] [-k clock] [-n top] [-f csv|vcd] "
+			"capture\n",
+			progName);
+}
+
+int main(int argc, char const *argv[]) {
+	const char *mapName = NULL, *bus = "addr", *clock = NULL, *format = NULL;
+	int top = 20;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			mapName = argv[++i];
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			bus = argv[++i];
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			clock = argv[++i];
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			top = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			format = argv[++i];
+		else if (*argv[i] != '-' && captureName == NULL)
+			captureName = argv[i];
+		else {
+			printHelp(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (mapName == NULL || captureName == NULL) {
+		printHelp(argv[0]);
+		return EXIT_FAILURE;
+	}
+	loadMap(mapName);
+	if ((fd = open(captureName, O_RDONLY)) < 0)
+		fatal("Can't read %s", captureName);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	useClock = clock != NULL;
+	if (format == NULL) {
+		const char *ext = strrchr(captureName, '.');
+		format = ext && strcmp(ext, ".vcd") == 0 ? "vcd" : "csv";
+	}
+	if (strcmp(format, "vcd") == 0)
+		readVcd(bus, clock);
+	else if (strcmp(format, "csv") == 0)
+		readCsv(bus, clock);
+	else
+		fatal("Unknown capture format, %s", format);
+	// the changes at the last time end the capture
+	execute(NO_ADDR, now);
+	lineNo = 0;
+	close(fd);
+	report(top);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1095 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "microcode.h"
+
+#define MEM_SIZE (64 * 1024)
+
+/* Port model
+
+   The simulator wires the 3 bit port numbers as follows. Ports 0 to 2 follow
+   the descriptions in ports.ucode, the rest hold the ALU and registers.
+
+   port  write                             read
+   0     microcode counter                 data/return stack pointer
+		 dOpt[1,0] 00 => jmp, step = 0      sOpt[3] 0 => data, 1 => return
+				   01 => jmp, step = 8      returns sp + the pending offset,
+				   10 => branch             which becomes the new sp, then
+				   11 => conditional branch sOpt[2..0] sets the pending
+		 dOpt[2] page to jump to            offset: +/-2, 4, 6 or 8
+		 dOpt[3] toggle supervisor mode
+   1     MMU                               MMU
+		 dOpt[3]=0 vAddr, dOpt[2] alt,      sOpt[3,2] 00 => vAddr
+				   dOpt[1,0] segment                  01 => page table
+		 dOpt[3]=1 dOpt[2] 1 => page table            10 => segment
+						   0 => memory                11 => memory
+				   dOpt[0] ~mem8            sOpt[0] ~mem8
+   2     program counter                   program counter, then
+											pc += sOpt[1,0] + 1
+											sOpt[3] 1 => pc + sOpt[1,0] + 1
+											without advancing
+											sOpt[2] 1 => check point
+   3     incrementor                       incrementor + 1
+   4     priority encoder                  index of the highest set bit,
+											0xffff if none
+   5     ALU, dOpt[0] 0 => a, 1 => b       ALU result, sOpt selects the
+											operation; sets cond to result == 0
+   6     context                           context
+   7     dOpt 0010 => push data stack      sOpt 0010 => top of data stack
+		 dOpt 0011 => push return stack    sOpt 0011 => top of return stack
+		 dOpt 0100 => data stack pointer   sOpt 0100 => data stack pointer
+		 dOpt 0101 => return stack pointer sOpt 0101 => return stack pointer
+		 otherwise memory data register    otherwise memory data register
+
+   Immediate commands put their 8 bit value on the bus. Port commands with the
+   test bit clear only execute when cond is set. A branch to its own step that
+   cannot be left halts the simulation.
+
+   Memory addresses are not yet translated by the page table.
+*/
+
+// read sources, one per distinct port and option behaviour
+enum reader {
+	R_IMM,
+	R_DS_PTR_OFF,
+	R_RS_PTR_OFF,
+	R_VADDR,
+	R_PGTBL,
+	R_SEG,
+	R_MEM8,
+	R_MEM16,
+	R_PC,
+	R_PC_OFFSET,
+	R_INC,
+	R_PEN,
+	R_ALU,
+	R_CTX,
+	R_DS_TOP,
+	R_RS_TOP,
+	R_DS_PTR,
+	R_RS_PTR,
+	R_MDR
+};
+
+// write destinations, one per distinct port and option behaviour
+enum writer {
+	W_JMP,
+	W_BRCH,
+	W_CNDBRCH,
+	W_VADDR,
+	W_PGTBL,
+	W_MEM8,
+	W_MEM16,
+	W_PC,
+	W_INC,
+	W_PEN,
+	W_ALU_A,
+	W_ALU_B,
+	W_CTX,
+	W_DS_PUSH,
+	W_RS_PUSH,
+	W_DS_PTR,
+	W_RS_PTR,
+	W_MDR
+};
+
+enum aluOp {
+	ALU_ADD,
+	ALU_SUB,
+	ALU_AND,
+	ALU_OR,
+	ALU_XOR,
+	ALU_NOT,
+	ALU_SHL,
+	ALU_SHR,
+	ALU_A,
+	ALU_B
+};
+
+/* A command decoded once, when the image is loaded, so that executing it
+ * needs no bit field extraction.
+ */
+struct op {
+	uint8_t rd;	  // enum reader
+	uint8_t wr;	  // enum writer
+	uint8_t sOpt; // operand for the reader, e.g. the ALU operation
+	uint8_t dOpt; // operand for the writer, e.g. the jmp page
+	bool tst;	  // only execute when cond is set
+	uint16_t imm; // bus value of an immediate command
+};
+
+// The architectural state of the machine
+struct state {
+	int cmdSet, page, cmdId, step;
+	bool supervisor;
+	bool cond;
+	bool halted;
+	uint16_t a, b, inc, pen, pc, chkPt, ctx, mar, mdr, ds, rs;
+	int16_t dsNxt, rsNxt; // offset applied by the next stack pointer read
+	int seg;
+	bool alt;
+	uint16_t pageTable[256];
+	uint8_t mem[MEM_SIZE];
+	uint64_t steps;
+};
+
+struct move;
+typedef void (*moveFn)(struct state *s, const struct move *mv);
+
+/* One step of a translated group that cannot change the microcode counter.
+ * The handler is chosen when the group is translated, specialised for the
+ * common register to register and immediate to register transfers. A fused
+ * handler executes len steps, reading the moves after its own.
+ */
+struct move {
+	moveFn fn;
+	struct op op;
+	uint16_t srcOff; // offset into struct state of a plain source register
+	uint16_t dstOff; // offset into struct state of a plain destination
+	uint8_t len;	 // steps the handler executes, 1 unless fused
+};
+
+/* A command group translated to threaded code. Steps that do not write the
+ * microcode counter are predecoded moves; a run of them from any step up to
+ * the next control step, runEnd, executes by calling the handlers of the run,
+ * each fused with the plain register moves after it, without computing the
+ * microcode address or checking the step limit per step.
+ */
+struct block {
+	struct move moves[CMDS_PER_GRP];
+	uint8_t runEnd[CMDS_PER_GRP]; // CMDS_PER_GRP if no control step follows
+	int16_t target[CMDS_PER_GRP]; // step of an immediate brch, else -1
+};
+
+struct sim {
+	uint16_t image[MC_STORE_SIZE];
+	struct op ops[MC_STORE_SIZE];
+	struct block *blocks[MC_STORE_SIZE / CMDS_PER_GRP]; // NULL until run
+	struct state s;
+};
+
+const int16_t stackOffsets[8] = {-2, -4, -6, -8, 2, 4, 6, 8};
+
+bool trace = false;
+
+void fatal(const char *msg, ...) {
+	va_list args;
+	fprintf(stderr, "\033[91mfatal: \033[0m");
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	exit(EXIT_FAILURE);
+}
+
+struct op decode(uint16_t cv) {
+	struct op o = {0};
+	int dOpt = cvDOpt(cv), sOpt = cvSOpt(cv);
+	o.dOpt = dOpt;
+	o.sOpt = sOpt;
+	if (cvIsImm(cv)) {
+		o.rd = R_IMM;
+		o.imm = cvImm(cv);
+	} else {
+		o.tst = cvTst(cv) == CMD_TST;
+		switch (cvSrc(cv)) {
+		case 0:
+			o.rd = sOpt & 8 ? R_RS_PTR_OFF : R_DS_PTR_OFF;
+			break;
+		case 1: {
+			static const uint8_t mmu[] = {R_VADDR, R_PGTBL, R_SEG, R_MEM8};
+			o.rd = mmu[sOpt >> 2];
+			if (o.rd == R_MEM8 && (sOpt & 1))
+				o.rd = R_MEM16;
+			break;
+		}
+		case 2:
+			o.rd = sOpt & 8 ? R_PC_OFFSET : R_PC;
+			break;
+		case 3:
+			o.rd = R_INC;
+			break;
+		case 4:
+			o.rd = R_PEN;
+			break;
+		case 5:
+			o.rd = R_ALU;
+			break;
+		case 6:
+			o.rd = R_CTX;
+			break;
+		default:
+			o.rd = sOpt == 2   ? R_DS_TOP
+				   : sOpt == 3 ? R_RS_TOP
+				   : sOpt == 4 ? R_DS_PTR
+				   : sOpt == 5 ? R_RS_PTR
+							   : R_MDR;
+		}
+	}
+	switch (cvDst(cv)) {
+	case 0: {
+		static const uint8_t mcc[] = {W_JMP, W_JMP, W_BRCH, W_CNDBRCH};
+		o.wr = mcc[dOpt & 3];
+		break;
+	}
+	case 1:
+		o.wr = !(dOpt & 8)	? W_VADDR
+			   : dOpt & 4	? W_PGTBL
+			   : dOpt & 1 ? W_MEM16
+						  : W_MEM8;
+		break;
+	case 2:
+		o.wr = W_PC;
+		break;
+	case 3:
+		o.wr = W_INC;
+		break;
+	case 4:
+		o.wr = W_PEN;
+		break;
+	case 5:
+		o.wr = dOpt & 1 ? W_ALU_B : W_ALU_A;
+		break;
+	case 6:
+		o.wr = W_CTX;
+		break;
+	default:
+		o.wr = dOpt == 2   ? W_DS_PUSH
+			   : dOpt == 3 ? W_RS_PUSH
+			   : dOpt == 4 ? W_DS_PTR
+			   : dOpt == 5 ? W_RS_PTR
+						   : W_MDR;
+	}
+	return o;
+}
+
+/* Write n commands to the image at addr, keeping the decoded commands up to
+ * date and discarding the translations of the groups they are in.
+ */
+void writeImage(struct sim *m, int addr, const uint16_t *values, int n) {
+	for (int i = 0; i < n; i++) {
+		m->image[addr + i] = values[i];
+		m->ops[addr + i] = decode(values[i]);
+	}
+	for (int g = addr / CMDS_PER_GRP; g * CMDS_PER_GRP < addr + n; g++) {
+		free(m->blocks[g]);
+		m->blocks[g] = NULL;
+	}
+}
+
+uint16_t readMem16(const struct state *s, uint16_t addr) {
+	return s->mem[addr] | s->mem[(uint16_t)(addr + 1)] << 8;
+}
+void writeMem16(struct state *s, uint16_t addr, uint16_t v) {
+	s->mem[addr] = v & 0xff;
+	s->mem[(uint16_t)(addr + 1)] = v >> 8;
+}
+
+uint16_t alu(struct state *s, int op) {
+	uint16_t r;
+	switch (op) {
+	case ALU_ADD:
+		r = s->a + s->b;
+		break;
+	case ALU_SUB:
+		r = s->a - s->b;
+		break;
+	case ALU_AND:
+		r = s->a & s->b;
+		break;
+	case ALU_OR:
+		r = s->a | s->b;
+		break;
+	case ALU_XOR:
+		r = s->a ^ s->b;
+		break;
+	case ALU_NOT:
+		r = ~s->a;
+		break;
+	case ALU_SHL:
+		r = s->a << 1;
+		break;
+	case ALU_SHR:
+		r = s->a >> 1;
+		break;
+	case ALU_B:
+		r = s->b;
+		break;
+	default:
+		r = s->a;
+	}
+	s->cond = r == 0;
+	return r;
+}
+
+uint16_t readPort(struct state *s, const struct op *o) {
+	uint16_t v;
+	switch (o->rd) {
+	case R_IMM:
+		return o->imm;
+	case R_DS_PTR_OFF:
+		s->ds += s->dsNxt;
+		s->dsNxt = stackOffsets[o->sOpt & 7];
+		return s->ds;
+	case R_RS_PTR_OFF:
+		s->rs += s->rsNxt;
+		s->rsNxt = stackOffsets[o->sOpt & 7];
+		return s->rs;
+	case R_VADDR:
+		return s->mar;
+	case R_PGTBL:
+		return s->pageTable[s->mar >> 8];
+	case R_SEG:
+		return s->seg;
+	case R_MEM8:
+		return s->mem[s->mar];
+	case R_MEM16:
+		return readMem16(s, s->mar);
+	case R_PC:
+		if (o->sOpt & 4)
+			s->chkPt = s->pc;
+		v = s->pc;
+		s->pc += (o->sOpt & 3) + 1;
+		return v;
+	case R_PC_OFFSET:
+		if (o->sOpt & 4)
+			s->chkPt = s->pc;
+		return s->pc + (o->sOpt & 3) + 1;
+	case R_INC:
+		return s->inc + 1;
+	case R_PEN:
+		if (s->pen == 0)
+			return 0xffff;
+		for (v = 15; !(s->pen >> v); v--)
+			;
+		return v;
+	case R_ALU:
+		return alu(s, o->sOpt);
+	case R_CTX:
+		return s->ctx;
+	case R_DS_TOP:
+		return readMem16(s, s->ds);
+	case R_RS_TOP:
+		return readMem16(s, s->rs);
+	case R_DS_PTR:
+		return s->ds;
+	case R_RS_PTR:
+		return s->rs;
+	default:
+		return s->mdr;
+	}
+}
+
+// step is the step being executed; s->step already holds the next one
+void writePort(struct state *s, const struct op *o, uint16_t v, int step) {
+	if (o->wr <= W_CNDBRCH && (o->dOpt & 8))
+		s->supervisor = !s->supervisor;
+	switch (o->wr) {
+	case W_JMP:
+		s->cmdId = v & SET_BITS(CMD_BITS);
+		s->step = (o->dOpt & 1) << (STEP_BITS - 1);
+		s->page = (o->dOpt >> 2) & 1;
+		break;
+	case W_CNDBRCH:
+		if (!s->cond)
+			break;
+		// fall through
+	case W_BRCH:
+		s->step = v & SET_BITS(STEP_BITS);
+		s->halted = s->step == step;
+		break;
+	case W_VADDR:
+		s->mar = v;
+		s->alt = (o->dOpt >> 2) & 1;
+		s->seg = o->dOpt & 3;
+		break;
+	case W_PGTBL:
+		s->pageTable[s->mar >> 8] = v;
+		break;
+	case W_MEM8:
+		s->mem[s->mar] = v & 0xff;
+		break;
+	case W_MEM16:
+		writeMem16(s, s->mar, v);
+		break;
+	case W_PC:
+		s->pc = v;
+		if (o->dOpt & 4)
+			s->chkPt = v;
+		break;
+	case W_INC:
+		s->inc = v;
+		break;
+	case W_PEN:
+		s->pen = v;
+		break;
+	case W_ALU_A:
+		s->a = v;
+		break;
+	case W_ALU_B:
+		s->b = v;
+		break;
+	case W_CTX:
+		s->ctx = v;
+		break;
+	case W_DS_PUSH:
+		s->ds -= 2;
+		writeMem16(s, s->ds, v);
+		break;
+	case W_RS_PUSH:
+		s->rs -= 2;
+		writeMem16(s, s->rs, v);
+		break;
+	case W_DS_PTR:
+		s->ds = v;
+		break;
+	case W_RS_PTR:
+		s->rs = v;
+		break;
+	default:
+		s->mdr = v;
+	}
+}
+
+// Run until halted or maxSteps commands have been executed in total, decoding
+// each command as it is executed
+void runNaive(struct sim *m, uint64_t maxSteps) {
+	struct state *s = &m->s;
+	while (s->steps < maxSteps && !s->halted) {
+		int addr = MC_GRP_ADDR(s->cmdSet, s->page, s->cmdId) + s->step;
+		struct op o = decode(m->image[addr]);
+		int step = s->step;
+		s->step = (step + 1) & SET_BITS(STEP_BITS);
+		s->steps++;
+		if (o.tst && !s->cond)
+			continue;
+		writePort(s, &o, readPort(s, &o), step);
+	}
+}
+
+// Execute the predecoded command at the microcode counter, returning it, or
+// NULL if it was skipped as cond was clear
+static inline const struct op *execute(struct sim *m) {
+	struct state *s = &m->s;
+	int addr = MC_GRP_ADDR(s->cmdSet, s->page, s->cmdId) + s->step;
+	const struct op *o = &m->ops[addr];
+	int step = s->step;
+	s->step = (step + 1) & SET_BITS(STEP_BITS);
+	s->steps++;
+	if (o->tst && !s->cond)
+		return NULL;
+	uint16_t v = readPort(s, o);
+	if (trace)
+		fprintf(stderr, "%d:%d:%d:%d [0x%4.4x] 0x%4.4x bus=0x%4.4x\n",
+				s->cmdSet, s->page, s->cmdId, step, addr, m->image[addr], v);
+	writePort(s, o, v, step);
+	return o;
+}
+
+// Run until halted or maxSteps commands have been executed in total, one
+// predecoded command at a time
+void run(struct sim *m, uint64_t maxSteps) {
+	struct state *s = &m->s;
+	while (s->steps < maxSteps && !s->halted)
+		execute(m);
+}
+
+// Run the group until it jmps, returning true, or it halts or maxSteps
+// commands have been executed in total
+bool runGroup(struct sim *m, uint64_t maxSteps) {
+	struct state *s = &m->s;
+	while (s->steps < maxSteps && !s->halted) {
+		const struct op *o = execute(m);
+		if (o && o->wr == W_JMP)
+			return true;
+	}
+	return false;
+}
+
+#define REG(s, off) (*(uint16_t *)((char *)(s) + (off)))
+
+void moveGeneric(struct state *s, const struct move *mv) {
+	if (!mv->op.tst || s->cond)
+		writePort(s, &mv->op, readPort(s, &mv->op), 0);
+}
+void moveImmReg(struct state *s, const struct move *mv) {
+	REG(s, mv->dstOff) = mv->op.imm;
+}
+void moveRegReg(struct state *s, const struct move *mv) {
+	REG(s, mv->dstOff) = REG(s, mv->srcOff);
+}
+void moveAluReg(struct state *s, const struct move *mv) {
+	REG(s, mv->dstOff) = alu(s, mv->op.sOpt);
+}
+
+/* Superinstructions, fused from two or three plain moves: an immediate (I),
+ * register (R) or ALU result (A) stored to a register
+ */
+#define PLAIN_I(j) REG(s, mv[j].dstOff) = mv[j].op.imm
+#define PLAIN_R(j) REG(s, mv[j].dstOff) = REG(s, mv[j].srcOff)
+#define PLAIN_A(j) REG(s, mv[j].dstOff) = alu(s, mv[j].op.sOpt)
+#define FUSED2(x, y)                                                   \
+	static void move##x##y(struct state *s, const struct move *mv) {  \
+		PLAIN_##x(0);                                                  \
+		PLAIN_##y(1);                                                  \
+	}
+#define FUSED3(x, y, z)                                                 \
+	static void move##x##y##z(struct state *s, const struct move *mv) { \
+		PLAIN_##x(0);                                                   \
+		PLAIN_##y(1);                                                   \
+		PLAIN_##z(2);                                                   \
+	}
+#define FUSED_Z(x, y)                                                      \
+	FUSED2(x, y) FUSED3(x, y, I) FUSED3(x, y, R) FUSED3(x, y, A)
+#define FUSED_YZ(x) FUSED_Z(x, I) FUSED_Z(x, R) FUSED_Z(x, A)
+FUSED_YZ(I)
+FUSED_YZ(R)
+FUSED_YZ(A)
+
+// Indexed by the kinds of the moves fused, I, R and A in turn
+#define FUSED_ROW(x) {move##x##I, move##x##R, move##x##A}
+#define FUSED3_ROWS(x) {FUSED_ROW(x##I), FUSED_ROW(x##R), FUSED_ROW(x##A)}
+static const moveFn fused2[3][3] = {FUSED_ROW(I), FUSED_ROW(R), FUSED_ROW(A)};
+static const moveFn fused3[3][3][3] = {FUSED3_ROWS(I), FUSED3_ROWS(R),
+									   FUSED3_ROWS(A)};
+
+// offset of the register a reader returns without side effects, else 0
+uint16_t plainSource(int rd) {
+	switch (rd) {
+	case R_VADDR:
+		return offsetof(struct state, mar);
+	case R_CTX:
+		return offsetof(struct state, ctx);
+	case R_DS_PTR:
+		return offsetof(struct state, ds);
+	case R_RS_PTR:
+		return offsetof(struct state, rs);
+	case R_MDR:
+		return offsetof(struct state, mdr);
+	}
+	return 0;
+}
+// offset of the register a writer only stores to, else 0
+uint16_t plainDestination(int wr) {
+	switch (wr) {
+	case W_INC:
+		return offsetof(struct state, inc);
+	case W_PEN:
+		return offsetof(struct state, pen);
+	case W_ALU_A:
+		return offsetof(struct state, a);
+	case W_ALU_B:
+		return offsetof(struct state, b);
+	case W_CTX:
+		return offsetof(struct state, ctx);
+	case W_DS_PTR:
+		return offsetof(struct state, ds);
+	case W_RS_PTR:
+		return offsetof(struct state, rs);
+	case W_MDR:
+		return offsetof(struct state, mdr);
+	}
+	return 0;
+}
+
+bool isControl(const struct op *o) {
+	return o->wr <= W_CNDBRCH;
+}
+
+// The kind of a plain move, its index in fused2 and fused3, else -1
+static int plainKind(moveFn fn) {
+	return fn == moveImmReg	  ? 0
+		   : fn == moveRegReg ? 1
+		   : fn == moveAluReg ? 2
+							  : -1;
+}
+
+struct block *translate(struct sim *m, int grp) {
+	struct block *b = malloc(sizeof(struct block));
+	const struct op *ops = &m->ops[grp * CMDS_PER_GRP];
+	int kind[CMDS_PER_GRP]; // of each step, see plainKind
+	int end = CMDS_PER_GRP, plain = 0;
+	if (b == NULL)
+		fatal("Out of memory translating group 0x%x\n", grp);
+	for (int i = CMDS_PER_GRP - 1; i >= 0; i--) {
+		struct move *mv = &b->moves[i];
+		const struct op *o = &ops[i];
+		mv->op = *o;
+		mv->srcOff = plainSource(o->rd);
+		mv->dstOff = plainDestination(o->wr);
+		if (o->tst || !mv->dstOff)
+			mv->fn = moveGeneric;
+		else if (o->rd == R_IMM)
+			mv->fn = moveImmReg;
+		else if (o->rd == R_ALU)
+			mv->fn = moveAluReg;
+		else if (mv->srcOff)
+			mv->fn = moveRegReg;
+		else
+			mv->fn = moveGeneric;
+		kind[i] = plainKind(mv->fn);
+		plain = kind[i] >= 0 ? plain + 1 : 0;
+		mv->len = plain > 3 ? 3 : plain > 1 ? plain : 1;
+		if (mv->len == 2)
+			mv->fn = fused2[kind[i]][kind[i + 1]];
+		else if (mv->len == 3)
+			mv->fn = fused3[kind[i]][kind[i + 1]][kind[i + 2]];
+		if (isControl(o))
+			end = i;
+		b->runEnd[i] = end;
+		b->target[i] = o->wr == W_BRCH && o->rd == R_IMM && !o->tst &&
+							   !(o->dOpt & 8)
+						   ? o->imm & SET_BITS(STEP_BITS)
+						   : -1;
+	}
+	return m->blocks[grp] = b;
+}
+
+// Run until halted or maxSteps commands have been executed in total, executing
+// runs of moves in translated groups with one address and step limit check
+void runThreaded(struct sim *m, uint64_t maxSteps) {
+	struct state *s = &m->s;
+	while (!s->halted) {
+		int grp = (s->cmdSet << PAGE_BITS | s->page) << CMD_BITS | s->cmdId;
+		const struct block *b = m->blocks[grp];
+		if (b == NULL)
+			b = translate(m, grp);
+		for (;;) {
+			int i = s->step, end = b->runEnd[i];
+			if (s->steps + (end - i) + 1 > maxSteps) {
+				run(m, maxSteps);
+				return;
+			}
+			for (int k = i, n; k < end; k += n) {
+				n = b->moves[k].len;
+				b->moves[k].fn(s, &b->moves[k]);
+			}
+			s->steps += end - i + (end < CMDS_PER_GRP);
+			if (end == CMDS_PER_GRP) {
+				s->step = 0;
+				continue;
+			}
+			if (b->target[end] >= 0) {
+				s->step = b->target[end];
+				if (s->step == end) {
+					s->halted = true;
+					return;
+				}
+				continue;
+			}
+			const struct op *o = &b->moves[end].op;
+			s->step = (end + 1) & SET_BITS(STEP_BITS);
+			if (o->tst && !s->cond)
+				continue;
+			writePort(s, o, readPort(s, o), end);
+			if (o->wr == W_JMP || s->halted)
+				break;
+		}
+	}
+}
+
+/* Load a microcode image written by mcasm: 16 bit commands, low byte first,
+ * one for each address of the geometry mcsim models
+ */
+void loadImage(struct sim *m, const char *fileName) {
+	FILE *f = fopen(fileName, "rb");
+	static unsigned char bytes[MC_STORE_SIZE * 2 + 1]; // + 1 to see a longer one
+	static uint16_t values[MC_STORE_SIZE];
+	size_t n;
+	if (f == NULL)
+		fatal("Can't read %s\n", fileName);
+	n = fread(bytes, 1, sizeof(bytes), f);
+	fclose(f);
+	if (n != MC_STORE_SIZE * 2)
+		fatal("%s is for another geometry than mcsim models\n", fileName);
+	for (int i = 0; i < MC_STORE_SIZE; i++)
+		values[i] = bytes[2 * i] | bytes[2 * i + 1] << 8;
+	writeImage(m, 0, values, MC_STORE_SIZE);
+}
+
+// Load raw bytes into main memory from a file[@addr] argument
+void loadMemory(struct sim *m, const char *arg) {
+	char *fileName = strdup(arg);
+	char *at = strrchr(fileName, '@');
+	long addr = 0;
+	FILE *f;
+	if (at) {
+		*at = '\0';
+		addr = strtol(at + 1, NULL, 0);
+	}
+	if (addr < 0 || addr >= MEM_SIZE)
+		fatal("Memory address out of range in %s\n", arg);
+	if ((f = fopen(fileName, "rb")) == NULL)
+		fatal("Can't read %s\n", fileName);
+	fread(m->s.mem + addr, 1, MEM_SIZE - addr, f);
+	fclose(f);
+	free(fileName);
+}
+
+const struct {
+	const char *name;
+	size_t offset;
+} registers[] = {
+	{"a", offsetof(struct state, a)},	  {"b", offsetof(struct state, b)},
+	{"inc", offsetof(struct state, inc)}, {"pen", offsetof(struct state, pen)},
+	{"pc", offsetof(struct state, pc)},	  {"ctx", offsetof(struct state, ctx)},
+	{"mar", offsetof(struct state, mar)}, {"mdr", offsetof(struct state, mdr)},
+	{"ds", offsetof(struct state, ds)},	  {"rs", offsetof(struct state, rs)},
+};
+
+#define REGISTER_CNT (int)(sizeof(registers) / sizeof(registers[0]))
+// beyond the registers, the state a test can set or expect
+enum { REG_COND = REGISTER_CNT, REG_STEPS, REG_HALTED, REG_END };
+
+const char *registerName(int r) {
+	static const char *const others[] = {"cond", "steps", "halted"};
+	return r < REGISTER_CNT ? registers[r].name : others[r - REGISTER_CNT];
+}
+
+// The register the len characters at name name, or -1 if none does
+int findRegister(const char *name, size_t len) {
+	for (int r = 0; r < REG_END; r++)
+		if (strlen(registerName(r)) == len &&
+			strncmp(name, registerName(r), len) == 0)
+			return r;
+	return -1;
+}
+
+void putRegister(struct state *s, int r, long value) {
+	if (r < REGISTER_CNT)
+		REG(s, registers[r].offset) = value;
+	else if (r == REG_COND)
+		s->cond = value != 0;
+	else if (r == REG_STEPS)
+		s->steps = value;
+	else
+		s->halted = value != 0;
+}
+
+long getRegister(const struct state *s, int r) {
+	if (r < REGISTER_CNT)
+		return REG(s, registers[r].offset);
+	return r == REG_COND	? s->cond
+		   : r == REG_STEPS ? (long)s->steps
+							: s->halted;
+}
+
+// Set a register from a name=value argument
+void setRegister(struct state *s, const char *arg) {
+	const char *eq = strchr(arg, '=');
+	int r;
+	if (eq == NULL)
+		fatal("Expected name=value, not %s\n", arg);
+	r = findRegister(arg, eq - arg);
+	if (r < 0 || r > REG_COND)
+		fatal("Unknown register in %s\n", arg);
+	putRegister(s, r, strtol(eq + 1, NULL, 0));
+}
+
+void printState(const struct state *s) {
+	printf("%s after %" PRIu64 " steps at %d:%d:%d:%d\n",
+		   s->halted ? "halted" : "stopped", s->steps, s->cmdSet, s->page,
+		   s->cmdId, s->step);
+	for (size_t r = 0; r < sizeof(registers) / sizeof(registers[0]); r++)
+		printf("%s=0x%4.4x ", registers[r].name,
+			   *(const uint16_t *)((const char *)s + registers[r].offset));
+	printf("cond=%d supervisor=%d\n", s->cond, s->supervisor);
+}
+
+/* Unit tests of command groups, written by mcasm from the test blocks of its
+ * inputs to image.tests, a line for each:
+ *
+ *   name addr input:line reg=value ... [expect reg=value ...]
+ *
+ * Each starts from a copy of the state set by the options, with the registers
+ * set, and runs the group at addr from step 0 until it jmps or halts. steps
+ * counts the jmp. The tests are split between -j forked processes, which
+ * print the tests that fail to a temporary file each.
+ */
+#define MAX_TEST_REGS 32
+#define TEST_MAX_STEPS 10000 // unless -n is given
+struct test {
+	const char *name, *where; // where is input:line
+	int addr;
+	int setCnt, expectCnt;
+	struct {
+		int reg;
+		long value;
+	} regs[MAX_TEST_REGS]; // those set, then those expected
+};
+
+// Read the tests from fileName, returning how many there are
+int loadTests(const char *fileName, struct test **tests) {
+	FILE *f = fopen(fileName, "r");
+	char *buf = NULL, *tok;
+	size_t cap = 0;
+	int cnt = 0, bits[4];
+	if (f == NULL)
+		fatal("Can't read %s\n", fileName);
+	*tests = NULL;
+	while (getline(&buf, &cap, f) > 0) {
+		struct test *t;
+		bool expecting = false;
+		if (sscanf(buf, "; geometry %d:%d:%d:%d", &bits[0], &bits[1],
+				   &bits[2], &bits[3]) == 4 &&
+			(bits[0] != CMDSET_BITS || bits[1] != PAGE_BITS ||
+			 bits[2] != CMD_BITS || bits[3] != STEP_BITS))
+			fatal("%s is for another geometry than mcsim models\n", fileName);
+		if (*buf == ';' || *buf == '\n')
+			continue;
+		if ((cnt & (cnt - 1)) == 0 &&
+			(*tests = realloc(*tests, 2 * (cnt + 1) * sizeof(**tests))) == NULL)
+			fatal("Out of memory loading %s\n", fileName);
+		t = &(*tests)[cnt++];
+		memset(t, 0, sizeof(*t));
+		buf[strcspn(buf, "\n")] = '\0';
+		if ((t->name = strtok(strdup(buf), " ")) == NULL ||
+			(tok = strtok(NULL, " ")) == NULL ||
+			(t->where = strtok(NULL, " ")) == NULL)
+			fatal("Expected a test, not %s\n", buf);
+		t->addr = strtol(tok, NULL, 0) & (MC_STORE_SIZE - 1);
+		while ((tok = strtok(NULL, " ")) != NULL) {
+			char *eq = strchr(tok, '=');
+			int r = eq ? findRegister(tok, eq - tok) : -1;
+			if (strcmp(tok, "expect") == 0) {
+				expecting = true;
+				continue;
+			}
+			if (r < 0 || (!expecting && r > REG_COND))
+				fatal("%s: unknown register %s in the test %s\n", t->where, tok,
+					  t->name);
+			if (t->setCnt + t->expectCnt == MAX_TEST_REGS)
+				fatal("%s: too many registers in the test %s\n", t->where,
+					  t->name);
+			t->regs[t->setCnt + t->expectCnt].reg = r;
+			t->regs[t->setCnt + t->expectCnt].value = strtol(eq + 1, NULL, 0);
+			if (expecting)
+				t->expectCnt++;
+			else
+				t->setCnt++;
+		}
+	}
+	free(buf);
+	fclose(f);
+	return cnt;
+}
+
+// Run the test from initial, printing why to f and returning false if it fails
+bool runTest(struct sim *m, const struct state *initial, const struct test *t,
+			 uint64_t maxSteps, FILE *f) {
+	struct state *s = &m->s;
+	bool ok = true;
+	int grp = t->addr >> STEP_BITS;
+	*s = *initial;
+	s->cmdSet = grp >> (PAGE_BITS + CMD_BITS);
+	s->page = (grp >> CMD_BITS) & SET_BITS(PAGE_BITS);
+	s->cmdId = grp & SET_BITS(CMD_BITS);
+	s->step = 0;
+	for (int i = 0; i < t->setCnt; i++)
+		putRegister(s, t->regs[i].reg, t->regs[i].value);
+	if (!runGroup(m, maxSteps) && !s->halted) {
+		fprintf(f, "%s: test %s is still in its group after %" PRIu64
+				   " steps\n",
+				t->where, t->name, s->steps);
+		return false;
+	}
+	for (int i = t->setCnt; i < t->setCnt + t->expectCnt; i++) {
+		int r = t->regs[i].reg;
+		long want = t->regs[i].value, got = getRegister(s, r);
+		if (r < REGISTER_CNT)
+			want &= 0xffff;
+		else if (r != REG_STEPS)
+			want = want != 0;
+		if (got == want)
+			continue;
+		if (ok)
+			fprintf(f, "%s: test %s failed:", t->where, t->name);
+		fprintf(f, "%s %s is %ld, expected %ld", ok ? "" : ",",
+				registerName(r), got, want);
+		ok = false;
+	}
+	if (!ok)
+		fputc('\n', f);
+	return ok;
+}
+
+/* Run the tests, jobs at a time, from the state of m, and print those that
+ * fail and a summary. Returns the number that fail.
+ */
+int runTests(struct sim *m, const struct test *tests, int cnt, int jobs,
+			 uint64_t maxSteps) {
+	struct state *initial = malloc(sizeof(struct state));
+	struct timespec start, end;
+	FILE **out;
+	pid_t *pids;
+	int failed = 0;
+	char line[4096];
+	if (jobs > cnt)
+		jobs = cnt > 0 ? cnt : 1;
+	out = calloc(jobs, sizeof(FILE *));
+	pids = calloc(jobs, sizeof(pid_t));
+	if (initial == NULL || out == NULL || pids == NULL)
+		fatal("Out of memory running the tests\n");
+	*initial = m->s;
+	initial->steps = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fflush(stdout);
+	for (int j = 0; j < jobs; j++) {
+		if ((out[j] = tmpfile()) == NULL)
+			fatal("Can't create a temporary file for the tests\n");
+		if ((pids[j] = jobs > 1 ? fork() : 0) < 0)
+			fatal("Can't fork to run the tests\n");
+		if (pids[j] > 0)
+			continue;
+		for (int i = (long)cnt * j / jobs; i < (long)cnt * (j + 1) / jobs; i++)
+			runTest(m, initial, &tests[i], maxSteps, out[j]);
+		if (jobs > 1) {
+			fflush(out[j]);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	// print the failures in the order of the tests
+	for (int j = 0; j < jobs; j++) {
+		if (jobs > 1)
+			waitpid(pids[j], NULL, 0);
+		rewind(out[j]);
+		while (fgets(line, sizeof(line), out[j])) {
+			fputs(line, stdout);
+			failed += line[strlen(line) - 1] == '\n';
+		}
+		fclose(out[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%d tests, %d failed, in %.3f s with %d jobs\n", cnt, failed,
+		   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		   jobs);
+	free(initial);
+	free(out);
+	free(pids);
+	return failed;
+}
+
+const struct engine {
+	const char *name;
+	void (*run)(struct sim *m, uint64_t maxSteps);
+} engines[] = {{"naive", runNaive}, {"table", run}, {"threaded", runThreaded}};
+
+// Run the engine from the current state and return the seconds taken
+double runTimed(const struct engine *e, struct sim *m, uint64_t maxSteps) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	e->run(m, maxSteps);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Run every engine from the same state and compare their speed and results
+bool bench(struct sim *m, uint64_t maxSteps) {
+	struct state *initial = malloc(2 * sizeof(struct state));
+	struct state *expected = initial + 1;
+	bool same = true;
+	if (initial == NULL)
+		fatal("Out of memory\n");
+	*initial = m->s;
+	printf("%-10s %12s %10s %10s %s\n", "engine", "steps", "seconds",
+		   "Msteps/s", "state");
+	for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+		double secs;
+		m->s = *initial;
+		secs = runTimed(&engines[e], m, maxSteps);
+		if (e == 0)
+			*expected = m->s;
+		printf("%-10s %12" PRIu64 " %10.3f %10.1f %s\n", engines[e].name,
+			   m->s.steps, secs, secs > 0 ? m->s.steps / secs / 1e6 : 0.0,
+			   memcmp(&m->s, expected, sizeof(m->s)) ? "MISMATCH" : "ok");
+		same = same && !memcmp(&m->s, expected, sizeof(m->s));
+	}
+	free(initial);
+	return same;
+}
+
+void printHelp(const char *progName) {
+	char *usage = "[-t] [-b] [-e naive|table|threaded] [-n maxSteps] "
+				  "[-c cmdSet] [-p page] [-g cmdId] [-r reg=value ...] "
+				  "[-m file[@addr] ...] [-T tests [-j jobs]] image\n";
+	fprintf(stdout, "Usage: %s %s", progName, usage);
+}
+
+int main(int argc, char const *argv[]) {
+	static struct sim m;
+	uint64_t maxSteps = 100 * 1000 * 1000;
+	const char *imageName = NULL, *testsName = NULL;
+	const struct engine *engine = &engines[2];
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	bool stepLimit = false;
+	bool benchmark = false;
+	double secs;
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i], *arg;
+		if (opt[0] != '-') {
+			imageName = opt;
+			continue;
+		} else if (strcmp(opt, "-t") == 0) {
+			trace = true;
+			continue;
+		} else if (strcmp(opt, "-b") == 0) {
+			benchmark = true;
+			continue;
+		} else if (i + 1 >= argc)
+			fatal("Missing value for option %s\n", opt);
+		arg = argv[++i];
+		if (strcmp(opt, "-n") == 0)
+			maxSteps = strtoull(arg, NULL, 0), stepLimit = true;
+		else if (strcmp(opt, "-T") == 0)
+			testsName = arg;
+		else if (strcmp(opt, "-j") == 0)
+			jobs = strtol(arg, NULL, 0) > 0 ? strtol(arg, NULL, 0) : jobs;
+		else if (strcmp(opt, "-e") == 0) {
+			for (engine = engines; strcmp(engine->name, arg) != 0; engine++)
+				if (engine == &engines[2])
+					fatal("Unknown engine, %s\n", arg);
+		} else if (strcmp(opt, "-c") == 0)
+			m.s.cmdSet = strtol(arg, NULL, 0) & SET_BITS(CMDSET_BITS);
+		else if (strcmp(opt, "-p") == 0)
+			m.s.page = strtol(arg, NULL, 0) & SET_BITS(PAGE_BITS);
+		else if (strcmp(opt, "-g") == 0)
+			m.s.cmdId = strtol(arg, NULL, 0) & SET_BITS(CMD_BITS);
+		else if (strcmp(opt, "-r") == 0)
+			setRegister(&m.s, arg);
+		else if (strcmp(opt, "-m") == 0)
+			loadMemory(&m, arg);
+		else
+			fatal("Unknown argument, %s\n", opt);
+	}
+	if (imageName == NULL) {
+		printHelp(argv[0]);
+		return EXIT_FAILURE;
+	}
+	loadImage(&m, imageName);
+	if (testsName) {
+		struct test *tests;
+		int cnt = loadTests(testsName, &tests);
+		// a test is of one group, so a loop that never leaves it fails soon
+		return runTests(&m, tests, cnt, jobs,
+						stepLimit ? maxSteps : TEST_MAX_STEPS)
+				   ? EXIT_FAILURE
+				   : EXIT_SUCCESS;
+	}
+	if (benchmark)
+		return bench(&m, maxSteps) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (trace) // only the table engine traces each step
+		engine = &engines[1];
+	secs = runTimed(engine, &m, maxSteps);
+	printState(&m.s);
+	fprintf(stderr, "%" PRIu64 " steps in %.3fs, %.1f Msteps/s\n", m.s.steps,
+			secs, secs > 0 ? m.s.steps / secs / 1e6 : 0.0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#ifndef MICROCODE_H
+#define MICROCODE_H
+
+/* The layout of the microcode store and of the commands in it, shared by the
+ * assembler and the simulator.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CMDS_PER_GRP 16
+#define CMDSET_BITS 3
+#define PAGE_BITS 1
+#define CMD_BITS 8
+#define STEP_BITS 4
+// number of commands in the microcode store
+#define MC_STORE_SIZE (1 << (CMDSET_BITS + PAGE_BITS + CMD_BITS + STEP_BITS))
+// construct the microcode address of the first step of a command group
+#define MC_GRP_ADDR(cmdSet, page, cmdId) \
+	(((((cmdSet) << PAGE_BITS) | (page)) << CMD_BITS | (cmdId)) << STEP_BITS)
+
+#define SET_BITS(n) ((1 << (n)) - 1) // value with lower n bits set
+
+#define CMD_TYPE_IMM 0
+#define CMD_TYPE_PORT 1
+#define CMD_TST 0
+#define CMD_NO_TST 1
+
+// port 0 writes the microcode counter, dOpt[1,0] selecting how
+#define MCC_PORT 0
+#define MCC_BRCH 2	  // branch to a step of the group
+#define MCC_CNDBRCH 3 // branch if cond is set, else step++
+
+/* Command layout
+	  iDDDDdddtSSSSsss
+   where:
+	i    0 => immediate instruction;
+		source value is a constant with value tSSSSsss
+	DDDD destination option
+	ddd  destination port
+	t    0 => test and conditionally execute
+	SSSS source option
+	sss  source port
+*/
+
+// extract parts of a Command Value
+static inline int cvType(uint16_t cv) {
+	return (cv >> 15) & 1;
+}
+static inline bool cvIsImm(uint16_t cv) {
+	return cvType(cv) == CMD_TYPE_IMM;
+}
+static inline int cvDOpt(uint16_t cv) {
+	return (cv >> 11) & 0xf;
+}
+static inline int cvDst(uint16_t cv) {
+	return (cv >> 8) & SET_BITS(3);
+}
+static inline int cvDSpec(uint16_t cv) {
+	return (cv >> 8) & SET_BITS(7);
+}
+static inline int cvTst(uint16_t cv) {
+	return (cv >> 7) & 1;
+}
+static inline int cvSOpt(uint16_t cv) {
+	return (cv >> 3) & 0xf;
+}
+static inline int cvSrc(uint16_t cv) {
+	return cv & SET_BITS(3);
+}
+static inline int cvSSpec(uint16_t cv) {
+	return cv & SET_BITS(7);
+}
+static inline int cvImm(uint16_t cv) {
+	return cv & 0xff;
+}
+
+#endif